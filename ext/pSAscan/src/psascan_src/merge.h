@@ -52,9 +52,17 @@
 
 namespace psascan_private {
 
-// Merge partial suffix arrays into final suffix array.
+// Size (in elements) of the buffer used for every stream during merging.
 template<typename block_offset_type>
-void merge(std::string output_filename, long ram_use, std::vector<half_block_info<block_offset_type> > &hblock_info) {
+long merge_buffer_size(long ram_use, long n_block) {
+  long pieces = (1 + sizeof(block_offset_type)) * n_block - 1 + sizeof(uint40);
+  return (ram_use + pieces - 1) / pieces;
+}
+
+// Merge partial suffix arrays into final suffix array. The suffix array
+// is passed, in order, to output->write().
+template<typename block_offset_type, typename output_type>
+void merge(output_type *output, long ram_use, std::vector<half_block_info<block_offset_type> > &hblock_info) {
   long n_block = (long)hblock_info.size();
   long text_length = 0;
 
@@ -62,8 +70,7 @@ void merge(std::string output_filename, long ram_use, std::vector<half_block_inf
   for (size_t j = 0; j < hblock_info.size(); ++j)
     text_length += hblock_info[j].end - hblock_info[j].beg;
 
-  long pieces = (1 + sizeof(block_offset_type)) * n_block - 1 + sizeof(uint40);
-  long buffer_size = (ram_use + pieces - 1) / pieces;
+  long buffer_size = merge_buffer_size<block_offset_type>(ram_use, n_block);
 
   fprintf(stderr, "\nMerge partial suffix arrays:\n");
   fprintf(stderr, "  buffer size per block = %ld (%.2LfMiB)\n",
@@ -72,9 +79,7 @@ void merge(std::string output_filename, long ram_use, std::vector<half_block_inf
   fprintf(stderr, "  sizeof(output_type) = %ld\n", sizeof(uint40));
 
   typedef async_vbyte_stream_reader<long> vbyte_reader_type;
-  typedef async_stream_writer<uint40> output_writer_type;
 
-  output_writer_type *output = new output_writer_type(output_filename, sizeof(uint40) * buffer_size);
   vbyte_reader_type **gap = new vbyte_reader_type*[n_block - 1];
   for (long i = 0; i < n_block; ++i) {
     hblock_info[i].psa->initialize_reading(sizeof(block_offset_type) * buffer_size);
@@ -165,7 +170,6 @@ void merge(std::string output_filename, long ram_use, std::vector<half_block_inf
   fprintf(stderr, "\r  100.0%%. Time: %.2Lfs. I/O: %.2LfMiB/s\n", merge_time, io_speed);
 
   // Clean up.
-  delete output;
   for (long i = 0; i < n_block; ++i) {
     hblock_info[i].psa->finish_reading();
     delete hblock_info[i].psa;
@@ -181,6 +185,17 @@ void merge(std::string output_filename, long ram_use, std::vector<half_block_inf
     utils::file_delete(hblock_info[i].gap_filename);
 }
 
+// Merge partial suffix arrays into final suffix array stored on disk.
+template<typename block_offset_type>
+void merge(std::string output_filename, long ram_use, std::vector<half_block_info<block_offset_type> > &hblock_info) {
+  typedef async_stream_writer<uint40> output_writer_type;
+
+  long buffer_size = merge_buffer_size<block_offset_type>(ram_use, (long)hblock_info.size());
+  output_writer_type *output = new output_writer_type(output_filename, sizeof(uint40) * buffer_size);
+  merge<block_offset_type, output_writer_type>(output, ram_use, hblock_info);
+  delete output;
+}
+
 }  // namespace psascan_private
 
 #endif  // __PSASCAN_SRC_MERGE_H_INCLUDED
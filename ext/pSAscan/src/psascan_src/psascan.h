@@ -52,9 +52,12 @@
 
 namespace psascan_private {
 
-void pSAscan(std::string input_filename, std::string output_filename,
-    std::string gap_filename, long ram_use, long max_threads,
-    bool verbose, long gap_buf_size = (1L << 21)) {
+// The final merge writes to the destination, which is either the name of
+// the output file or a pointer to an object with a write(long) method.
+template<typename destination_type>
+void pSAscan_aux(std::string input_filename, destination_type destination,
+    std::string output_filename, std::string gap_filename, long ram_use,
+    long max_threads, bool verbose, long gap_buf_size) {
   long n_gap_buffers = 2 * max_threads;
   if (ram_use < 6L) {
     fprintf(stderr, "Error: not enough memory to run pSAscan.\n");
@@ -119,11 +122,11 @@ void pSAscan(std::string input_filename, std::string output_filename,
   if (max_block_size < (1L << 31)) {
     std::vector<half_block_info<int> > hblock_info = partial_sufsort<int>(input_filename,
         output_filename, gap_filename, length, max_block_size, ram_use, max_threads, gap_buf_size, verbose);
-    merge<int>(output_filename, ram_use, hblock_info);
+    merge<int>(destination, ram_use, hblock_info);
   } else {
     std::vector<half_block_info<uint40> > hblock_info = partial_sufsort<uint40>(input_filename,
         output_filename, gap_filename, length, max_block_size, ram_use, max_threads, gap_buf_size, verbose);
-    merge<uint40>(output_filename, ram_use, hblock_info);
+    merge<uint40>(destination, ram_use, hblock_info);
   }
   long double total_time = utils::wclock() - start;
 
@@ -132,6 +135,25 @@ void pSAscan(std::string input_filename, std::string output_filename,
   fprintf(stderr, "  speed: %.2LfMiB/s\n", ((1.L * length) / (1L << 20)) / total_time);
 }
 
+void pSAscan(std::string input_filename, std::string output_filename,
+    std::string gap_filename, long ram_use, long max_threads,
+    bool verbose, long gap_buf_size = (1L << 21)) {
+  output_filename = utils::absolute_path(output_filename);
+  pSAscan_aux(input_filename, output_filename, output_filename,
+      gap_filename, ram_use, max_threads, verbose, gap_buf_size);
+}
+
+// Compute the suffix array and pass it, in order, to output->write()
+// instead of writing it to disk. The output filename is then only used
+// as a prefix for the temporary files.
+template<typename output_type>
+void pSAscan(std::string input_filename, output_type *output,
+    std::string output_filename, std::string gap_filename, long ram_use,
+    long max_threads, bool verbose, long gap_buf_size = (1L << 21)) {
+  pSAscan_aux(input_filename, output, output_filename,
+      gap_filename, ram_use, max_threads, verbose, gap_buf_size);
+}
+
 }  // namespace psascan_private
 
 
@@ -0,0 +1,134 @@
+// Copyright 2017 Riku Walve
+
+#ifndef WANDA_BACKEND_H_
+#define WANDA_BACKEND_H_
+
+#include <iostream>
+#include <string>
+
+#include <sdsl/bit_vectors.hpp>
+#include <sdsl/wavelet_trees.hpp>
+
+#include "dna_bwt.h"
+#include "rle_bwt.h"
+
+// Representations of the BWT the index can be built with. The values are
+// stored in the graph files, so they must not change.
+enum backend_t {
+  BACKEND_HUFF_RRR = 0,
+  BACKEND_HUFF_RRR63 = 1,
+  BACKEND_HUFF_PLAIN = 2,
+  BACKEND_HUFF_IL = 3,
+  BACKEND_MATRIX = 4,
+  BACKEND_RLE = 5,
+  BACKEND_DNA = 6,
+  BACKEND_COUNT = 7
+};
+
+// Huffman shaped wavelet trees over compressed, plain and interleaved
+// bitvectors, from the smallest to the fastest, and a wavelet matrix,
+// which is only log(sigma) levels deep over the dense alphabet. The run
+// length compressed BWT, rle_wt_t, scales with the number of runs, and the
+// occurrence table of dna_wt_t answers a rank from one cache line.
+typedef sdsl::wt_huff<sdsl::rrr_vector<127> > huff_rrr_wt_t;
+typedef sdsl::wt_huff<sdsl::rrr_vector<63> > huff_rrr63_wt_t;
+typedef sdsl::wt_huff<sdsl::bit_vector> huff_plain_wt_t;
+typedef sdsl::wt_huff<sdsl::bit_vector_il<> > huff_il_wt_t;
+typedef sdsl::wm_int<sdsl::bit_vector> matrix_wt_t;
+
+// The id of each backend
+template<class wt_t> struct backend_traits;
+
+template<> struct backend_traits<huff_rrr_wt_t> {
+  static const backend_t id = BACKEND_HUFF_RRR;
+};
+
+template<> struct backend_traits<huff_rrr63_wt_t> {
+  static const backend_t id = BACKEND_HUFF_RRR63;
+};
+
+template<> struct backend_traits<huff_plain_wt_t> {
+  static const backend_t id = BACKEND_HUFF_PLAIN;
+};
+
+template<> struct backend_traits<huff_il_wt_t> {
+  static const backend_t id = BACKEND_HUFF_IL;
+};
+
+template<> struct backend_traits<matrix_wt_t> {
+  static const backend_t id = BACKEND_MATRIX;
+};
+
+template<> struct backend_traits<rle_wt_t> {
+  static const backend_t id = BACKEND_RLE;
+};
+
+template<> struct backend_traits<dna_wt_t> {
+  static const backend_t id = BACKEND_DNA;
+};
+
+// Hints that a position of the BWT is about to be read, for the backends
+// that can tell where it is
+template<class wt_t>
+static inline void prefetch_position(const wt_t &, const size_t) {}
+
+static inline void prefetch_position(const dna_wt_t &wt, const size_t i) {
+  wt.prefetch(i);
+}
+
+// Instantiates a class template for every backend
+#define INSTANTIATE_BACKENDS(name) \
+  template class name<huff_rrr_wt_t>; \
+  template class name<huff_rrr63_wt_t>; \
+  template class name<huff_plain_wt_t>; \
+  template class name<huff_il_wt_t>; \
+  template class name<matrix_wt_t>; \
+  template class name<rle_wt_t>; \
+  template class name<dna_wt_t>;
+
+static inline const char *backend_name(const backend_t backend) {
+  switch (backend) {
+    case BACKEND_HUFF_RRR: return "huff-rrr";
+    case BACKEND_HUFF_RRR63: return "huff-rrr63";
+    case BACKEND_HUFF_PLAIN: return "huff-plain";
+    case BACKEND_HUFF_IL: return "huff-il";
+    case BACKEND_MATRIX: return "matrix";
+    case BACKEND_RLE: return "rle";
+    case BACKEND_DNA: return "dna";
+    default: return "unknown";
+  }
+}
+
+static inline backend_t parse_backend(const std::string &name) {
+  for (size_t i = 0; i < BACKEND_COUNT; i++) {
+    if (name == backend_name(static_cast<backend_t>(i))) {
+      return static_cast<backend_t>(i);
+    }
+  }
+
+  std::cerr << "[E::" << __func__ << "]: Unknown backend \"" << name << "\", expected one of";
+  for (size_t i = 0; i < BACKEND_COUNT; i++) {
+    std::cerr << " " << backend_name(static_cast<backend_t>(i));
+  }
+  std::cerr << "!" << std::endl;
+  exit(1);
+}
+
+// Runs task.run<wt_t>() with the BWT representation of a backend
+template<typename task_t>
+void dispatch_backend(const backend_t backend, const task_t &task) {
+  switch (backend) {
+    case BACKEND_HUFF_RRR: task.template run<huff_rrr_wt_t>(); break;
+    case BACKEND_HUFF_RRR63: task.template run<huff_rrr63_wt_t>(); break;
+    case BACKEND_HUFF_PLAIN: task.template run<huff_plain_wt_t>(); break;
+    case BACKEND_HUFF_IL: task.template run<huff_il_wt_t>(); break;
+    case BACKEND_MATRIX: task.template run<matrix_wt_t>(); break;
+    case BACKEND_RLE: task.template run<rle_wt_t>(); break;
+    case BACKEND_DNA: task.template run<dna_wt_t>(); break;
+    default:
+      std::cerr << "[E::" << __func__ << "]: Unknown backend " << backend << "!" << std::endl;
+      exit(1);
+  }
+}
+
+#endif
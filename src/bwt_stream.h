@@ -0,0 +1,247 @@
+// Copyright 2017 Riku Walve
+
+#ifndef WANDA_BWT_STREAM_H_
+#define WANDA_BWT_STREAM_H_
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sdsl/int_vector.hpp>
+
+#include "psascan_src/uint40.h"
+#include "psascan_src/async_stream_writer.h"
+
+#include "lcp.h"
+#include "sa_samples.h"
+
+// Number of suffix array values handed to the decoder at a time
+#define BWT_STREAM_BLOCK_SIZE (1L << 20)
+
+// Memory of the blocks and the buffers of the BWT writer
+#define BWT_STREAM_RAM (2 * BWT_STREAM_BLOCK_SIZE * 5 + (8L << 20))
+
+// Consumes the suffix array from pSAscan, writing the BWT, SA samples and,
+// if first is given, the rows starting a new k-mer.
+//
+// The suffix array is collected into blocks of uint40s by the caller, while
+// a decoder thread turns the previous block into BWT symbols and samples.
+// The BWT is written to disk through an asynchronous writer, so the merge,
+// the random accesses to the text and the I/O all run concurrently. The
+// k-mer boundaries of a block are split between worker threads, as
+// comparing the suffixes is the most expensive part of decoding. The
+// workers are started once and take a range of every block.
+class bwt_stream_t {
+public:
+  bwt_stream_t(const unsigned char *text, const size_t n, const std::string &bwt_filename,
+      sa_samples_builder_t *samples, const size_t k = 0, sdsl::bit_vector *first = nullptr,
+      const size_t threads = 1) :
+      m_text(text), m_n(n), m_samples(samples), m_k(k), m_first(first),
+      m_threads(std::max(static_cast<size_t>(1), threads)),
+      m_previous(0), m_active_filled(0), m_passive_filled(0), m_passive_offset(0),
+      m_avail(false), m_finished(false), m_block(0), m_range_size(0), m_pending(0),
+      m_stopping(false) {
+    m_active = new uint40[BWT_STREAM_BLOCK_SIZE];
+    m_passive = new uint40[BWT_STREAM_BLOCK_SIZE];
+
+    m_writer = new psascan_private::async_stream_writer<unsigned char>(bwt_filename);
+    m_thread = std::thread(decoder_thread_code, this);
+
+    if (m_first != nullptr) {
+      for (size_t t = 0; t < m_threads; t++) {
+        m_workers.push_back(std::thread(first_thread_code, this, t));
+      }
+    }
+  }
+
+  ~bwt_stream_t() {
+    if (m_active_filled > 0)
+      send_active_block();
+
+    std::unique_lock<std::mutex> lk(m_mutex);
+    m_finished = true;
+    lk.unlock();
+    m_cv.notify_one();
+
+    m_thread.join();
+
+    lk = std::unique_lock<std::mutex>(m_first_mutex);
+    m_stopping = true;
+    lk.unlock();
+    m_first_cv.notify_all();
+
+    for (size_t t = 0; t < m_workers.size(); t++) {
+      m_workers[t].join();
+    }
+
+    // Flushes the remaining BWT to disk
+    delete m_writer;
+
+    delete[] m_active;
+    delete[] m_passive;
+  }
+
+  inline void write(const long value) {
+    m_active[m_active_filled++] = uint40(value);
+
+    if (m_active_filled == BWT_STREAM_BLOCK_SIZE)
+      send_active_block();
+  }
+
+private:
+  static void decoder_thread_code(bwt_stream_t *stream) {
+    while (true) {
+      std::unique_lock<std::mutex> lk(stream->m_mutex);
+      while (!stream->m_avail && !stream->m_finished)
+        stream->m_cv.wait(lk);
+
+      if (!stream->m_avail && stream->m_finished) {
+        lk.unlock();
+        return;
+      }
+      lk.unlock();
+
+      stream->decode_passive_block();
+
+      lk.lock();
+      stream->m_avail = false;
+      lk.unlock();
+      stream->m_cv.notify_one();
+    }
+  }
+
+  // Marks the k-mer boundaries in the t-th range of every passive block
+  // until the stream is finished
+  static void first_thread_code(bwt_stream_t *stream, const size_t t) {
+    size_t block = 0;
+    while (true) {
+      std::unique_lock<std::mutex> lk(stream->m_first_mutex);
+      while (stream->m_block == block && !stream->m_stopping)
+        stream->m_first_cv.wait(lk);
+
+      if (stream->m_block == block) {
+        return;
+      }
+      block = stream->m_block;
+
+      const long beg = std::min(stream->m_passive_filled,
+        static_cast<long>(t) * stream->m_range_size);
+      const long end = std::min(stream->m_passive_filled, beg + stream->m_range_size);
+      lk.unlock();
+
+      stream->mark_first(beg, end);
+
+      lk.lock();
+      if (--stream->m_pending == 0) {
+        lk.unlock();
+        stream->m_done_cv.notify_one();
+      }
+    }
+  }
+
+  // Marks the k-mer boundaries in the rows [beg, end) of the passive block
+  void mark_first(const long beg, const long end) {
+    size_t previous = (beg == 0) ? m_previous : m_passive[beg - 1].ull();
+    for (long j = beg; j < end; j++) {
+      const size_t sa = m_passive[j].ull();
+      const size_t i = m_passive_offset + static_cast<size_t>(j);
+      (*m_first)[i] = (i == 0) || (lcp(m_text, m_n, previous, sa, m_k) < m_k);
+      previous = sa;
+    }
+  }
+
+  void decode_passive_block() {
+    // Blocks start at multiples of the block size, so ranges aligned to 64
+    // rows never share a word of the bitvector
+    if (!m_workers.empty()) {
+      std::unique_lock<std::mutex> lk(m_first_mutex);
+      m_range_size = ((m_passive_filled + static_cast<long>(m_threads) - 1) /
+        static_cast<long>(m_threads) + 63) & ~63L;
+      m_pending = m_workers.size();
+      m_block++;
+      lk.unlock();
+      m_first_cv.notify_all();
+    }
+
+    for (long j = 0; j < m_passive_filled; j++) {
+      const size_t sa = m_passive[j].ull();
+      m_writer->write(m_text[sa == 0 ? m_n - 1 : sa - 1]);
+
+      m_samples->add(m_passive_offset + static_cast<size_t>(j), sa);
+    }
+
+    if (!m_workers.empty()) {
+      std::unique_lock<std::mutex> lk(m_first_mutex);
+      while (m_pending > 0)
+        m_done_cv.wait(lk);
+    }
+
+    if (m_passive_filled > 0) {
+      m_previous = m_passive[m_passive_filled - 1].ull();
+    }
+  }
+
+  // Waits for the decoder to finish the previous block and hands it the
+  // active block
+  void send_active_block() {
+    std::unique_lock<std::mutex> lk(m_mutex);
+    while (m_avail)
+      m_cv.wait(lk);
+
+    std::swap(m_active, m_passive);
+    m_passive_offset += static_cast<size_t>(m_passive_filled);
+    m_passive_filled = m_active_filled;
+    m_active_filled = 0;
+
+    m_avail = true;
+    lk.unlock();
+    m_cv.notify_one();
+  }
+
+private:
+  const unsigned char *m_text;
+  const size_t m_n;
+
+  sa_samples_builder_t *m_samples;
+
+  const size_t m_k;
+  sdsl::bit_vector *m_first;
+  const size_t m_threads;
+
+  // Suffix of the previous row
+  size_t m_previous;
+
+  uint40 *m_active;
+  uint40 *m_passive;
+  long m_active_filled;
+  long m_passive_filled;
+
+  // Row of the first suffix in the passive block
+  size_t m_passive_offset;
+
+  // Used for synchronization with the decoder thread
+  bool m_avail;
+  bool m_finished;
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+
+  psascan_private::async_stream_writer<unsigned char> *m_writer;
+  std::thread m_thread;
+
+  // The workers marking the k-mer boundaries, the number of the block they
+  // are given, the rows of the block each one takes, how many of them are
+  // still working on it and whether the stream is finished
+  std::vector<std::thread> m_workers;
+  size_t m_block;
+  long m_range_size;
+  size_t m_pending;
+  bool m_stopping;
+  std::mutex m_first_mutex;
+  std::condition_variable m_first_cv;
+  std::condition_variable m_done_cv;
+};
+
+#endif
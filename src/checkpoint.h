@@ -0,0 +1,295 @@
+// Copyright 2017 Riku Walve
+
+#ifndef WANDA_CHECKPOINT_H_
+#define WANDA_CHECKPOINT_H_
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sdsl/io.hpp>
+
+#define CHECKPOINT_VERSION 1
+
+// Buffer size for checksumming
+#define CHECKPOINT_BUFFER_SIZE (1 << 20)
+
+// Records the outputs of the completed phases of a build in a manifest, so
+// that an interrupted build can skip them when it is run again. The files
+// of a phase are synced to disk and checksummed before the phase is
+// recorded, and the manifest is replaced atomically, so a phase is either
+// recorded with intact files or not at all.
+//
+// The manifest is <prefix>.checkpoint and a phase stores its parts in
+// <prefix>.checkpoint.<phase>.<part>.
+class checkpoint_t {
+public:
+  checkpoint_t(const std::string &prefix, const std::string &input, const size_t k,
+      const size_t kmax, const size_t backend, const size_t sample_density, const bool psi) :
+      m_manifest(prefix + ".checkpoint") {
+    struct stat st;
+    if (stat(input.c_str(), &st) != 0) {
+      std::cerr << "[E::" << __func__ << "]: Unable to read \"" << input << "\"!" << std::endl;
+      exit(1);
+    }
+
+    // Phases are only reused for the same input and parameters
+    std::ostringstream id;
+    id << st.st_size << " " << st.st_mtime << " " << k << " " << kmax << " " << backend <<
+      " " << sample_density << " " << psi << " " << input;
+    m_input = id.str();
+
+    read_manifest();
+  }
+
+  checkpoint_t(const checkpoint_t&) = delete;
+  checkpoint_t& operator=(const checkpoint_t&) = delete;
+
+  inline bool done(const std::string &phase) const {
+    return find(phase) != m_phases.size();
+  }
+
+  inline std::string filename(const std::string &phase, const std::string &part) const {
+    return m_manifest + "." + phase + "." + part;
+  }
+
+  // Stores a part of a phase, to be recorded with commit
+  template<typename T>
+  void store(const std::string &phase, const std::string &part, const T &structure) const {
+    if (!sdsl::store_to_file(structure, filename(phase, part))) {
+      std::cerr << "[E::" << __func__ << "]: Unable to write to \"" <<
+        filename(phase, part) << "\"!" << std::endl;
+      exit(1);
+    }
+  }
+
+  // Loads a part of a completed phase
+  template<typename T>
+  void load(const std::string &phase, const std::string &part, T *structure) const {
+    if (!sdsl::load_from_file(*structure, filename(phase, part))) {
+      std::cerr << "[E::" << __func__ << "]: Unable to read \"" <<
+        filename(phase, part) << "\"!" << std::endl;
+      exit(1);
+    }
+  }
+
+  // Records a phase as completed once its parts are on disk
+  void commit(const std::string &phase, const std::vector<std::string> &parts) {
+    entry_t entry;
+    entry.name = phase;
+    for (size_t i = 0; i < parts.size(); i++) {
+      const std::string part_filename = filename(phase, parts[i]);
+      sync_file(part_filename);
+
+      part_t part;
+      part.name = parts[i];
+      part.checksum = checksum(part_filename, &part.length);
+      entry.parts.push_back(part);
+    }
+
+    const size_t i = find(phase);
+    if (i == m_phases.size()) {
+      m_phases.push_back(entry);
+    } else {
+      m_phases[i] = entry;
+    }
+
+    write_manifest();
+  }
+
+  // Removes a phase whose outputs are no longer needed
+  void discard(const std::string &phase) {
+    const size_t i = find(phase);
+    if (i == m_phases.size()) {
+      return;
+    }
+
+    const entry_t entry = m_phases[i];
+    m_phases.erase(m_phases.begin() + static_cast<long>(i));
+    write_manifest();
+
+    remove_parts(entry);
+  }
+
+  // Removes the manifest and every phase, after the build has completed
+  void finish() {
+    std::remove(m_manifest.c_str());
+    for (size_t i = 0; i < m_phases.size(); i++) {
+      remove_parts(m_phases[i]);
+    }
+    m_phases.clear();
+  }
+
+private:
+  struct part_t {
+    std::string name;
+    size_t length;
+    uint64_t checksum;
+  };
+
+  struct entry_t {
+    std::string name;
+    std::vector<part_t> parts;
+  };
+
+  size_t find(const std::string &phase) const {
+    for (size_t i = 0; i < m_phases.size(); i++) {
+      if (m_phases[i].name == phase) return i;
+    }
+    return m_phases.size();
+  }
+
+  void remove_parts(const entry_t &entry) const {
+    for (size_t i = 0; i < entry.parts.size(); i++) {
+      std::remove(filename(entry.name, entry.parts[i].name).c_str());
+    }
+  }
+
+  // FNV-1a over 64-bit words, with the trailing bytes hashed one at a time
+  static uint64_t checksum(const std::string &filename, size_t *length) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in.good()) {
+      std::cerr << "[E::" << __func__ << "]: Unable to read \"" << filename << "\"!" << std::endl;
+      exit(1);
+    }
+
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    *length = 0;
+
+    std::vector<char> buffer(CHECKPOINT_BUFFER_SIZE);
+    while (in.read(buffer.data(), CHECKPOINT_BUFFER_SIZE) || in.gcount() > 0) {
+      const size_t count = static_cast<size_t>(in.gcount());
+      size_t i = 0;
+      for (; i + 8 <= count; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, buffer.data() + i, 8);
+        hash = (hash ^ word) * 0x100000001b3ULL;
+      }
+      for (; i < count; i++) {
+        hash = (hash ^ static_cast<uint8_t>(buffer[i])) * 0x100000001b3ULL;
+      }
+      *length += count;
+    }
+
+    return hash;
+  }
+
+  static void sync_file(const std::string &filename) {
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1 || fsync(fd) != 0) {
+      std::cerr << "[E::" << __func__ << "]: Unable to sync \"" << filename << "\"!" << std::endl;
+      exit(1);
+    }
+    close(fd);
+  }
+
+  // Reads the manifest, keeping the phases whose parts are intact
+  void read_manifest() {
+    std::ifstream in(m_manifest);
+    if (!in.good()) {
+      return;
+    }
+
+    std::string magic, input;
+    size_t version;
+    in >> magic >> version >> std::ws;
+    std::getline(in, input);
+    if (magic != "wanda-checkpoint" || version != CHECKPOINT_VERSION || input != m_input) {
+      std::cerr << "[V::" << __func__ << "]: Ignoring the checkpoint of another build" << std::endl;
+      return;
+    }
+
+    std::string name, part;
+    size_t length;
+    uint64_t hash;
+    while (in >> name >> part >> length >> hash) {
+      if (!done(name)) {
+        entry_t entry;
+        entry.name = name;
+        m_phases.push_back(entry);
+      }
+
+      part_t p;
+      p.name = part;
+      p.length = length;
+      p.checksum = hash;
+      m_phases[find(name)].parts.push_back(p);
+    }
+
+    for (size_t i = 0; i < m_phases.size();) {
+      if (intact(m_phases[i])) {
+        std::cerr << "[V::" << __func__ << "]: Resuming after phase " << m_phases[i].name << std::endl;
+        i++;
+      } else {
+        std::cerr << "[V::" << __func__ << "]: Redoing corrupted phase " << m_phases[i].name << std::endl;
+        remove_parts(m_phases[i]);
+        m_phases.erase(m_phases.begin() + static_cast<long>(i));
+      }
+    }
+  }
+
+  bool intact(const entry_t &entry) const {
+    for (size_t i = 0; i < entry.parts.size(); i++) {
+      const std::string part_filename = filename(entry.name, entry.parts[i].name);
+
+      struct stat st;
+      if (stat(part_filename.c_str(), &st) != 0 ||
+          static_cast<size_t>(st.st_size) != entry.parts[i].length) {
+        return false;
+      }
+
+      size_t length;
+      if (checksum(part_filename, &length) != entry.parts[i].checksum) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Writes the manifest to a temporary file and renames it over the old one
+  void write_manifest() const {
+    const std::string temporary = m_manifest + ".tmp";
+    {
+      std::ofstream out(temporary, std::ios::trunc);
+      out << "wanda-checkpoint " << CHECKPOINT_VERSION << "\n" << m_input << "\n";
+      for (size_t i = 0; i < m_phases.size(); i++) {
+        for (size_t j = 0; j < m_phases[i].parts.size(); j++) {
+          const part_t &part = m_phases[i].parts[j];
+          out << m_phases[i].name << " " << part.name << " " << part.length << " " <<
+            part.checksum << "\n";
+        }
+      }
+
+      out.close();
+      if (out.fail()) {
+        std::cerr << "[E::" << __func__ << "]: Unable to write to \"" << temporary << "\"!" << std::endl;
+        exit(1);
+      }
+    }
+
+    sync_file(temporary);
+    if (std::rename(temporary.c_str(), m_manifest.c_str()) != 0) {
+      std::cerr << "[E::" << __func__ << "]: Unable to write to \"" << m_manifest << "\"!" << std::endl;
+      exit(1);
+    }
+
+    // The rename is durable once the directory is synced
+    const size_t slash = m_manifest.rfind('/');
+    sync_file((slash == std::string::npos) ? "." : m_manifest.substr(0, slash + 1));
+  }
+
+  const std::string m_manifest;
+  std::string m_input;
+  std::vector<entry_t> m_phases;
+};
+
+#endif
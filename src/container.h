@@ -0,0 +1,214 @@
+// Copyright 2017 Riku Walve
+
+#ifndef WANDA_CONTAINER_H_
+#define WANDA_CONTAINER_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <istream>
+#include <memory>
+#include <string>
+
+#include "mapped.h"
+
+// "WANDA\0\0\0" in little endian
+#define CONTAINER_MAGIC 0x00000041444e4157ULL
+#define CONTAINER_VERSION 11
+
+// Sections start at page boundaries
+#define CONTAINER_ALIGNMENT 4096
+
+// Flags of the header. The PSI section is only stored with CONTAINER_PSI.
+#define CONTAINER_PSI 1
+
+enum container_section_t {
+  SECTION_BWT = 0,
+  SECTION_SA = 1,
+  SECTION_FIRST = 2,
+  SECTION_LCP = 3,
+  SECTION_ALPHABET = 4,
+  SECTION_PSI = 5,
+  SECTION_TEXT = 6,
+  SECTION_COUNT = 7
+};
+
+// Fixed size header at the start of a .wanda file
+struct container_header_t {
+  uint64_t magic;
+  uint64_t version;
+
+  // Order of the graph, the cap of the stored LCP array, length of the text,
+  // the representation of the BWT, see backend.h, and the flags
+  uint64_t k;
+  uint64_t kmax;
+  uint64_t size;
+  uint64_t backend;
+  uint64_t flags;
+
+  uint64_t offsets[SECTION_COUNT];
+  uint64_t lengths[SECTION_COUNT];
+};
+
+// Writes the sections of a graph into a single file. The file is written
+// next to the target and renamed over it when closed, so that graphs still
+// mapped from the target keep their contents.
+class container_writer_t {
+public:
+  container_writer_t(const std::string &filename, const size_t k, const size_t kmax,
+      const size_t size, const size_t backend, const size_t flags) :
+      m_filename(filename), m_out(filename + ".tmp", std::ios::binary | std::ios::trunc) {
+    if (!m_out.good()) {
+      std::cerr << "[E::" << __func__ << "]: Unable to write to \"" << filename << "\"!" << std::endl;
+      exit(1);
+    }
+
+    std::memset(&m_header, 0, sizeof(m_header));
+    m_header.magic = CONTAINER_MAGIC;
+    m_header.version = CONTAINER_VERSION;
+    m_header.k = k;
+    m_header.kmax = kmax;
+    m_header.size = size;
+    m_header.backend = backend;
+    m_header.flags = flags;
+
+    // Reserve space for the header, which is filled in when closing
+    m_out.write(reinterpret_cast<const char*>(&m_header), sizeof(m_header));
+  }
+
+  ~container_writer_t() {
+    m_out.seekp(0);
+    m_out.write(reinterpret_cast<const char*>(&m_header), sizeof(m_header));
+    m_out.close();
+
+    if (m_out.fail() || std::rename((m_filename + ".tmp").c_str(), m_filename.c_str()) != 0) {
+      std::cerr << "[E::" << __func__ << "]: Unable to write to \"" << m_filename << "\"!" << std::endl;
+    }
+  }
+
+  template<typename T>
+  void store(const container_section_t id, const T &structure) {
+    const uint64_t position = static_cast<uint64_t>(m_out.tellp());
+    const uint64_t offset = (position + CONTAINER_ALIGNMENT - 1) & ~static_cast<uint64_t>(CONTAINER_ALIGNMENT - 1);
+    for (uint64_t i = position; i < offset; i++) {
+      m_out.put('\0');
+    }
+
+    structure.serialize(m_out);
+
+    m_header.offsets[id] = offset;
+    m_header.lengths[id] = static_cast<uint64_t>(m_out.tellp()) - offset;
+  }
+
+private:
+  const std::string m_filename;
+  std::ofstream m_out;
+  container_header_t m_header;
+};
+
+// Maps a .wanda file into memory for loading. The arrays of the dna
+// backend, the packed text and the SA samples are used where they lie in
+// the mapping, see mapped_array_t, and keep it alive for as long as the
+// graph is. The sdsl structures are deserialized from the mapping into
+// copies of their own.
+class container_t {
+public:
+  explicit container_t(const std::string &filename) : m_data(nullptr), m_length(0) {
+    const int fd = open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0) {
+      std::cerr << "[E::" << __func__ << "]: Unable to read \"" << filename << "\"!" << std::endl;
+      exit(1);
+    }
+
+    m_length = static_cast<size_t>(st.st_size);
+    if (m_length < sizeof(m_header)) {
+      std::cerr << "[E::" << __func__ << "]: \"" << filename << "\" is not a graph file!" << std::endl;
+      exit(1);
+    }
+
+    void *data = mmap(nullptr, m_length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      std::cerr << "[E::" << __func__ << "]: Unable to map \"" << filename << "\"!" << std::endl;
+      exit(1);
+    }
+
+    m_data = static_cast<const char*>(data);
+    m_mapping = std::make_shared<const mapping_t>(m_data, m_length);
+
+    std::memcpy(&m_header, m_data, sizeof(m_header));
+    if (m_header.magic != CONTAINER_MAGIC) {
+      std::cerr << "[E::" << __func__ << "]: \"" << filename << "\" is not a graph file!" << std::endl;
+      exit(1);
+    }
+
+    if (m_header.version != CONTAINER_VERSION) {
+      std::cerr << "[E::" << __func__ << "]: \"" << filename << "\" has version " <<
+        m_header.version << ", expected " << CONTAINER_VERSION << "!" << std::endl;
+      exit(1);
+    }
+
+    for (size_t i = 0; i < SECTION_COUNT; i++) {
+      if (m_header.offsets[i] + m_header.lengths[i] > m_length) {
+        std::cerr << "[E::" << __func__ << "]: \"" << filename << "\" is truncated!" << std::endl;
+        exit(1);
+      }
+    }
+  }
+
+  container_t(const container_t&) = delete;
+  container_t& operator=(const container_t&) = delete;
+
+  inline size_t k() const {
+    return m_header.k;
+  }
+
+  inline size_t kmax() const {
+    return m_header.kmax;
+  }
+
+  inline size_t size() const {
+    return m_header.size;
+  }
+
+  inline size_t backend() const {
+    return m_header.backend;
+  }
+
+  inline size_t flags() const {
+    return m_header.flags;
+  }
+
+  // Pointer to the start of a section in the mapping
+  inline const char *section(const container_section_t id) const {
+    return m_data + m_header.offsets[id];
+  }
+
+  template<typename T>
+  void load(const container_section_t id, T *structure) const {
+    memory_buffer_t buffer(m_mapping, section(id), m_header.lengths[id]);
+    std::istream in(&buffer);
+    structure->load(in);
+  }
+
+  static bool exists(const std::string &filename) {
+    struct stat st;
+    return stat(filename.c_str(), &st) == 0;
+  }
+
+private:
+  const char *m_data;
+  size_t m_length;
+  std::shared_ptr<const mapping_t> m_mapping;
+  container_header_t m_header;
+};
+
+#endif
@@ -0,0 +1,432 @@
+// Copyright 2017 Riku Walve
+
+#ifndef WANDA_DNA_BWT_H_
+#define WANDA_DNA_BWT_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <sdsl/bit_vectors.hpp>
+#include <sdsl/wavelet_trees.hpp>
+
+#include "mapped.h"
+#include "sparse.h"
+
+// Bytes in a cache line, which is the size of a block of the occurrence table
+#define DNA_LINE_BYTES 64
+
+// A block is 2 words of counts followed by 6 words of 2-bit symbols
+#define DNA_LINE_WORDS 8
+#define DNA_COUNT_WORDS 2
+#define DNA_LINE_SYMBOLS ((DNA_LINE_WORDS - DNA_COUNT_WORDS) * 32)
+
+// The counts of a block are relative to a superblock of 2^20 blocks, so
+// that they fit in 32 bits
+#define DNA_SUPERBLOCK_BITS 20
+
+// Allocates cache line aligned memory for the blocks
+template<typename T>
+struct line_allocator_t {
+  typedef T value_type;
+
+  line_allocator_t() {}
+  template<typename U> line_allocator_t(const line_allocator_t<U> &) {}
+
+  T *allocate(const size_t n) {
+    void *p = nullptr;
+    if (posix_memalign(&p, DNA_LINE_BYTES, n * sizeof(T)) != 0) {
+      throw std::bad_alloc();
+    }
+    return static_cast<T*>(p);
+  }
+
+  void deallocate(T *p, size_t) {
+    free(p);
+  }
+
+  template<typename U> bool operator==(const line_allocator_t<U> &) const { return true; }
+  template<typename U> bool operator!=(const line_allocator_t<U> &) const { return false; }
+};
+
+// Occurrence table specialised for DNA, with the interface of the sdsl
+// wavelet trees the index uses. The four most frequent symbols are packed
+// in 2 bits each, interleaved with their counts before the block, so that a
+// rank is answered from a single cache line with a few popcounts. The other
+// symbols, like the separators, are rare and kept aside in a sparse
+// bitvector of their positions and a wavelet tree of their own. Their slots
+// in the blocks hold the code of the least frequent of the four, whose
+// counts are corrected by the number of rare symbols.
+class dna_wt_t {
+public:
+  typedef uint64_t size_type;
+  typedef uint8_t value_type;
+
+  // Number of distinct symbols
+  size_type sigma;
+
+  dna_wt_t() : sigma(0), m_size(0), m_common(4, 0), m_slots(256, 4), m_fill(0), m_has_rare(false) {}
+
+  template<uint8_t width>
+  dna_wt_t(sdsl::int_vector_buffer<width> &buffer, const size_type size) :
+      sigma(0), m_size(size), m_common(4, 0), m_slots(256, 4), m_fill(0), m_has_rare(false) {
+    std::vector<size_type> counts(256, 0);
+    for (size_type i = 0; i < size; i++) {
+      counts[static_cast<uint8_t>(buffer[i])]++;
+    }
+
+    // The four most frequent symbols are packed, in the order of their codes
+    std::vector<bool> common(256, false);
+    for (size_t s = 0; s < 4; s++) {
+      size_t best = 256;
+      for (size_t c = 0; c < 256; c++) {
+        if (!common[c] && counts[c] > 0 && (best == 256 || counts[c] > counts[best])) {
+          best = c;
+        }
+      }
+      if (best != 256) common[best] = true;
+    }
+
+    size_t slot = 0;
+    for (size_t c = 0; c < 256; c++) {
+      sigma += (counts[c] > 0);
+      if (common[c]) {
+        m_common[slot] = static_cast<uint8_t>(c);
+        m_slots[c] = static_cast<uint8_t>(slot++);
+      }
+    }
+
+    // Slots without a symbol repeat the last one
+    for (size_t s = slot; s > 0 && s < 4; s++) {
+      m_common[s] = m_common[slot - 1];
+    }
+
+    for (size_t s = 1; s < slot; s++) {
+      if (counts[m_common[s]] < counts[m_common[m_fill]]) {
+        m_fill = static_cast<uint8_t>(s);
+      }
+    }
+
+    const size_type lines = size / DNA_LINE_SYMBOLS + 1;
+    std::vector<uint64_t, line_allocator_t<uint64_t> > words(lines * DNA_LINE_WORDS, 0);
+
+    sdsl::bit_vector rare(size, 0);
+    std::vector<uint8_t> exceptions;
+
+    std::vector<uint64_t> totals(4, 0);
+    for (size_type line = 0; line < lines; line++) {
+      if ((line & ((1ULL << DNA_SUPERBLOCK_BITS) - 1)) == 0) {
+        m_superblocks.insert(m_superblocks.end(), totals.begin(), totals.end());
+      }
+
+      uint64_t *block = words.data() + line * DNA_LINE_WORDS;
+      const uint64_t *superblock = m_superblocks.data() + m_superblocks.size() - 4;
+      block[0] = (totals[0] - superblock[0]) | ((totals[1] - superblock[1]) << 32);
+      block[1] = (totals[2] - superblock[2]) | ((totals[3] - superblock[3]) << 32);
+
+      const size_type begin = line * DNA_LINE_SYMBOLS;
+      const size_type end = std::min(size, begin + DNA_LINE_SYMBOLS);
+      for (size_type i = begin; i < end; i++) {
+        const uint8_t c = static_cast<uint8_t>(buffer[i]);
+        uint64_t s = m_slots[c];
+        if (s == 4) {
+          rare[i] = 1;
+          exceptions.push_back(c);
+          s = m_fill;
+        }
+
+        block[DNA_COUNT_WORDS + (i - begin) / 32] |= s << (2 * ((i - begin) % 32));
+        totals[s]++;
+      }
+    }
+
+    m_lines = mapped_array_t<uint64_t, line_allocator_t<uint64_t> >(std::move(words));
+    m_has_rare = !exceptions.empty();
+    m_rare = rare_symbols_t(rare, exceptions);
+  }
+
+  inline size_type size() const {
+    return m_size;
+  }
+
+  // Hints that position i is about to be read
+  inline void prefetch(const size_type i) const {
+    __builtin_prefetch(line(i));
+  }
+
+  inline value_type operator[](const size_type i) const {
+    const uint64_t s = (line(i)[DNA_COUNT_WORDS + (i % DNA_LINE_SYMBOLS) / 32] >>
+      (2 * (i % 32))) & 3;
+    if (s == m_fill && m_has_rare && m_rare.contains(i)) {
+      return m_rare.symbol(m_rare.rank(i));
+    }
+
+    return m_common[s];
+  }
+
+  // Occurrences of c in [0, i)
+  size_type rank(const size_type i, const value_type c) const {
+    const uint8_t s = m_slots[c];
+    if (s == 4) {
+      return m_has_rare ? m_rare.rank(i, c) : 0;
+    }
+
+    const size_type count = occurrences(i, s);
+    return (s == m_fill && m_has_rare) ? count - m_rare.rank(i) : count;
+  }
+
+  // Position of the i-th occurrence of c, counting from 1
+  size_type select(const size_type i, const value_type c) const {
+    const uint8_t s = m_slots[c];
+    if (s == 4) {
+      return m_rare.select(i, c);
+    }
+
+    // The last block with fewer than i occurrences before it
+    size_type low = 0, high = m_lines.size() / DNA_LINE_WORDS;
+    while (high - low > 1) {
+      const size_type middle = low + (high - low) / 2;
+      if (rank(middle * DNA_LINE_SYMBOLS, c) < i) {
+        low = middle;
+      } else {
+        high = middle;
+      }
+    }
+
+    // Then the word holding the occurrence, and the occurrence in the word
+    size_type position = low * DNA_LINE_SYMBOLS;
+    size_type remaining = i - rank(position, c);
+    const uint64_t *block = line(position);
+    for (size_t w = DNA_COUNT_WORDS; w < DNA_LINE_WORDS; w++, position += 32) {
+      uint64_t matches = match(block[w], s);
+      if (s == m_fill && m_has_rare) {
+        matches &= ~rare_mask(position);
+      }
+
+      // The last block is padded with the symbol of slot 0
+      const size_type valid = (m_size > position) ? m_size - position : 0;
+      if (valid < 32) {
+        matches &= (1ULL << (2 * valid)) - 1;
+      }
+
+      const size_type count = static_cast<size_type>(__builtin_popcountll(matches));
+      if (count >= remaining) {
+        for (size_type j = 1; j < remaining; j++) {
+          matches &= matches - 1;
+        }
+        return position + static_cast<size_type>(__builtin_ctzll(matches)) / 2;
+      }
+      remaining -= count;
+    }
+
+    return m_size;
+  }
+
+  // For each symbol c in [i, j), its rank at i and at j, like the sdsl trees.
+  // The symbols are reported in the order of their codes.
+  template<class t_cs, class t_ranks>
+  void interval_symbols(const size_type i, const size_type j, size_type &k, t_cs &cs,
+      t_ranks &rank_c_i, t_ranks &rank_c_j) const {
+    const size_type rare_i = m_has_rare ? m_rare.rank(i) : 0;
+    const size_type rare_j = m_has_rare ? m_rare.rank(j) : 0;
+
+    size_type left[4], right[4];
+    all_occurrences(i, left);
+    all_occurrences(j, right);
+    left[m_fill] -= rare_i;
+    right[m_fill] -= rare_j;
+
+    k = 0;
+    for (uint8_t s = 0; s < 4 && (s == 0 || m_common[s] != m_common[s - 1]); s++) {
+      if (right[s] > left[s]) {
+        cs[k] = m_common[s];
+        rank_c_i[k] = left[s];
+        rank_c_j[k] = right[s];
+        k++;
+      }
+    }
+
+    if (rare_j == rare_i) {
+      return;
+    }
+
+    // The ranks among the rare symbols are their ranks in the whole BWT. The
+    // tree of the rare symbols takes vectors, so each thread reuses its own.
+    static thread_local std::vector<value_type> symbols;
+    static thread_local std::vector<size_type> exceptions_i, exceptions_j;
+    const sdsl::wt_huff<> &rare = m_rare.symbols();
+    if (symbols.size() < rare.sigma) {
+      symbols.resize(rare.sigma);
+      exceptions_i.resize(rare.sigma);
+      exceptions_j.resize(rare.sigma);
+    }
+
+    size_type count;
+    rare.interval_symbols(rare_i, rare_j, count, symbols, exceptions_i, exceptions_j);
+
+    for (size_type t = 0; t < count; t++) {
+      // Insert in the order of the codes
+      size_type u = k++;
+      for (; u > 0 && cs[u - 1] > symbols[t]; u--) {
+        cs[u] = cs[u - 1];
+        rank_c_i[u] = rank_c_i[u - 1];
+        rank_c_j[u] = rank_c_j[u - 1];
+      }
+      cs[u] = symbols[t];
+      rank_c_i[u] = exceptions_i[t];
+      rank_c_j[u] = exceptions_j[t];
+    }
+  }
+
+  size_type serialize(std::ostream &out, sdsl::structure_tree_node * = nullptr,
+      std::string = "") const {
+    size_type written = sdsl::write_member(m_size, out);
+    written += sdsl::write_member(sigma, out);
+    for (size_t s = 0; s < 4; s++) {
+      written += sdsl::write_member(m_common[s], out);
+    }
+    written += sdsl::write_member(m_fill, out);
+    written += sdsl::write_member(m_has_rare, out);
+
+    written += m_lines.serialize(out, DNA_LINE_BYTES);
+
+    written += sdsl::write_member(m_superblocks.size(), out);
+    for (size_t j = 0; j < m_superblocks.size(); j++) {
+      written += sdsl::write_member(m_superblocks[j], out);
+    }
+
+    written += m_rare.serialize(out);
+    return written;
+  }
+
+  void load(std::istream &in) {
+    sdsl::read_member(m_size, in);
+    sdsl::read_member(sigma, in);
+    m_slots = std::vector<uint8_t>(256, 4);
+    for (size_t s = 0; s < 4; s++) {
+      sdsl::read_member(m_common[s], in);
+    }
+    sdsl::read_member(m_fill, in);
+    sdsl::read_member(m_has_rare, in);
+
+    // Slots without a symbol repeat the last one, so map the first of each
+    for (size_t s = 4; s > 0; s--) {
+      m_slots[m_common[s - 1]] = static_cast<uint8_t>(s - 1);
+    }
+
+    m_lines.load(in);
+
+    size_t superblocks;
+    sdsl::read_member(superblocks, in);
+    m_superblocks = std::vector<uint64_t>(superblocks);
+    for (size_t j = 0; j < superblocks; j++) {
+      sdsl::read_member(m_superblocks[j], in);
+    }
+
+    m_rare.load(in);
+  }
+
+private:
+  inline const uint64_t *line(const size_type i) const {
+    return m_lines.data() + (i / DNA_LINE_SYMBOLS) * DNA_LINE_WORDS;
+  }
+
+  // Occurrences of slot s in [0, i), from one block
+  inline size_type occurrences(const size_type i, const uint8_t s) const {
+    const size_type j = i / DNA_LINE_SYMBOLS;
+    const uint64_t *block = m_lines.data() + j * DNA_LINE_WORDS;
+
+    size_type count = m_superblocks[(j >> DNA_SUPERBLOCK_BITS) * 4 + s] +
+      ((block[s / 2] >> (32 * (s % 2))) & 0xffffffffULL);
+
+    const size_type offset = i % DNA_LINE_SYMBOLS;
+    const size_type words = offset / 32;
+    for (size_type w = 0; w < words; w++) {
+      count += static_cast<size_type>(__builtin_popcountll(match(block[DNA_COUNT_WORDS + w], s)));
+    }
+
+    const size_type rest = offset % 32;
+    if (rest > 0) {
+      const uint64_t mask = (1ULL << (2 * rest)) - 1;
+      count += static_cast<size_type>(
+        __builtin_popcountll(match(block[DNA_COUNT_WORDS + words], s) & mask));
+    }
+
+    return count;
+  }
+
+  // Occurrences of every slot in [0, i), from one block. The symbols of
+  // slot 0 are those that match none of the others.
+  inline void all_occurrences(const size_type i, size_type *counts) const {
+    const size_type j = i / DNA_LINE_SYMBOLS;
+    const uint64_t *block = m_lines.data() + j * DNA_LINE_WORDS;
+    const uint64_t *superblock = m_superblocks.data() + (j >> DNA_SUPERBLOCK_BITS) * 4;
+
+    const size_type offset = i % DNA_LINE_SYMBOLS;
+    const size_type words = offset / 32, rest = offset % 32;
+    const uint64_t mask = (1ULL << (2 * rest)) - 1;
+
+    size_type total = offset;
+    for (uint8_t s = 1; s < 4; s++) {
+      size_type count = 0;
+      for (size_type w = 0; w < words; w++) {
+        count += static_cast<size_type>(__builtin_popcountll(match(block[DNA_COUNT_WORDS + w], s)));
+      }
+      if (rest > 0) {
+        count += static_cast<size_type>(
+          __builtin_popcountll(match(block[DNA_COUNT_WORDS + words], s) & mask));
+      }
+
+      total -= count;
+      counts[s] = superblock[s] + ((block[s / 2] >> (32 * (s % 2))) & 0xffffffffULL) + count;
+    }
+    counts[0] = superblock[0] + (block[0] & 0xffffffffULL) + total;
+  }
+
+  // The low bit of every 2-bit symbol equal to s
+  static inline uint64_t match(const uint64_t word, const uint8_t s) {
+    const uint64_t x = ~(word ^ (s * 0x5555555555555555ULL));
+    return x & (x >> 1) & 0x5555555555555555ULL;
+  }
+
+  // The low bits of the rare symbols among the 32 symbols from position
+  inline uint64_t rare_mask(const size_type position) const {
+    uint64_t mask = 0;
+    if (position >= m_size) {
+      return mask;
+    }
+
+    const size_type end = m_rare.rank(std::min(m_size, position + 32));
+    for (size_type p = m_rare.rank(position); p < end; p++) {
+      mask |= 1ULL << (2 * (m_rare.position(p) - position));
+    }
+    return mask;
+  }
+
+  size_type m_size;
+
+  // The symbol packed in each slot, and the slot of each symbol, or 4 if it
+  // is rare
+  std::vector<uint8_t> m_common;
+  std::vector<uint8_t> m_slots;
+
+  // The slot standing in for the rare symbols
+  uint8_t m_fill;
+  bool m_has_rare;
+
+  // Blocks of DNA_LINE_WORDS words, each starting with the counts of the
+  // slots before the block, relative to its superblock. Stored aligned to
+  // the blocks, so that the blocks of a mapped graph are read in place.
+  mapped_array_t<uint64_t, line_allocator_t<uint64_t> > m_lines;
+
+  // Counts of the slots before each superblock
+  std::vector<uint64_t> m_superblocks;
+
+  rare_symbols_t m_rare;
+};
+
+#endif
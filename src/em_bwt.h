@@ -0,0 +1,226 @@
+// Copyright 2017 Riku Walve
+
+#ifndef WANDA_EM_BWT_H_
+#define WANDA_EM_BWT_H_
+
+#include <cstdio>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sdsl/int_vector.hpp>
+
+#include "psascan_src/uint40.h"
+#include "psascan_src/utils.h"
+#include "psascan_src/async_stream_writer.h"
+
+#include "sa_samples.h"
+
+// Buffer size (in bytes) of every stream used by the external memory BWT
+#define EM_BWT_BUFFER_SIZE (1L << 20)
+
+// Text chunks are identified by a byte during the passes
+#define EM_BWT_MAX_CHUNKS 255
+
+// Buffered sequential writer for a temporary file
+template<typename value_type>
+class em_writer_t {
+public:
+  explicit em_writer_t(const std::string &filename) : m_filled(0) {
+    m_file = psascan_private::utils::open_file(filename, "w");
+    m_size = std::max(1L, EM_BWT_BUFFER_SIZE / static_cast<long>(sizeof(value_type)));
+    m_buffer = new value_type[m_size];
+  }
+
+  ~em_writer_t() {
+    flush();
+    std::fclose(m_file);
+    delete[] m_buffer;
+  }
+
+  inline void write(const value_type x) {
+    m_buffer[m_filled++] = x;
+    if (m_filled == m_size)
+      flush();
+  }
+
+private:
+  void flush() {
+    psascan_private::utils::add_objects_to_file(m_buffer, m_filled, m_file);
+    m_filled = 0;
+  }
+
+  std::FILE *m_file;
+  value_type *m_buffer;
+  long m_size;
+  long m_filled;
+};
+
+// Buffered sequential reader for a temporary file
+template<typename value_type>
+class em_reader_t {
+public:
+  em_reader_t(const std::string &filename, const long length) :
+      m_remaining(length), m_filled(0), m_pos(0) {
+    m_file = psascan_private::utils::open_file(filename, "r");
+    m_size = std::max(1L, EM_BWT_BUFFER_SIZE / static_cast<long>(sizeof(value_type)));
+    m_buffer = new value_type[m_size];
+  }
+
+  ~em_reader_t() {
+    std::fclose(m_file);
+    delete[] m_buffer;
+  }
+
+  inline value_type read() {
+    if (m_pos == m_filled)
+      refill();
+    return m_buffer[m_pos++];
+  }
+
+private:
+  void refill() {
+    m_filled = std::min(m_size, m_remaining);
+    psascan_private::utils::read_n_objects_from_file(m_buffer, m_filled, m_file);
+    m_remaining -= m_filled;
+    m_pos = 0;
+  }
+
+  std::FILE *m_file;
+  value_type *m_buffer;
+  long m_size;
+  long m_remaining;
+  long m_filled;
+  long m_pos;
+};
+
+// Chooses the text chunk length so that a chunk and the stream buffers of
+// all the chunks fit in the RAM budget. Returns 0 if that is not possible.
+static inline size_t em_bwt_chunk_length(const size_t n, const long ram_use) {
+  for (size_t chunks = 1; chunks <= EM_BWT_MAX_CHUNKS; chunks++) {
+    const size_t length = (n + chunks - 1) / chunks;
+    const size_t buffers = (chunks + 3) * EM_BWT_BUFFER_SIZE;
+    if (length + buffers <= static_cast<size_t>(ram_use))
+      return length;
+  }
+
+  return 0;
+}
+
+// Smallest RAM budget em_bwt can run in for a text of length n
+static inline long em_bwt_min_ram_use(const size_t n) {
+  size_t min = n + 4 * EM_BWT_BUFFER_SIZE;
+  for (size_t chunks = 2; chunks <= EM_BWT_MAX_CHUNKS; chunks++) {
+    min = std::min(min, (n + chunks - 1) / chunks + (chunks + 3) * EM_BWT_BUFFER_SIZE);
+  }
+
+  return static_cast<long>(min);
+}
+
+// Constructs the BWT and SA samples from a suffix array on disk, without
+// holding the whole text in memory.
+//
+// The text is split into chunks that fit in the RAM budget. One pass over
+// the suffix array distributes the position of the BWT symbol of each row
+// to the file of its chunk and records the chunk of every row. Each chunk
+// is then loaded in turn to resolve its symbols sequentially, and a final
+// pass merges the symbols back into row order. The suffix array is deleted
+// after the first pass, unless it is to be kept.
+static void em_bwt(const std::string &input, const std::string &suffix, const size_t n,
+    const long ram_use, const std::string &bwt, sa_samples_builder_t *samples,
+    const bool keep_suffix = false) {
+  const size_t chunk_length = em_bwt_chunk_length(n, ram_use);
+  if (chunk_length == 0) {
+    std::cerr << "[E::" << __func__ << "]: RAM budget of " << (ram_use >> 20) <<
+      " MiB is too small for a text of " << (n >> 20) << " MiB!" << std::endl;
+    exit(1);
+  }
+
+  const size_t chunks = (n + chunk_length - 1) / chunk_length;
+  std::cerr << "[V::" << __func__ << "]: " << chunks << " chunks of " <<
+    chunk_length << " symbols" << std::endl;
+
+  const std::string ids_filename = bwt + ".ids";
+  std::vector<std::string> chunk_filenames(chunks);
+  std::vector<long> chunk_sizes(chunks, 0);
+  for (size_t p = 0; p < chunks; p++) {
+    chunk_filenames[p] = bwt + ".chunk." + psascan_private::utils::intToStr(p);
+  }
+
+  // Distribute the suffix array to the chunks
+  {
+    em_reader_t<uint40> sa_reader(suffix, static_cast<long>(n));
+    em_writer_t<uint8_t> ids(ids_filename);
+
+    std::vector<em_writer_t<uint40>*> offsets(chunks);
+    for (size_t p = 0; p < chunks; p++) {
+      offsets[p] = new em_writer_t<uint40>(chunk_filenames[p] + ".pos");
+    }
+
+    for (size_t i = 0; i < n; i++) {
+      const size_t sa = sa_reader.read().ull();
+      const size_t pos = (sa == 0) ? n - 1 : sa - 1;
+      const size_t p = pos / chunk_length;
+
+      ids.write(static_cast<uint8_t>(p));
+      offsets[p]->write(uint40(static_cast<uint64_t>(pos - p * chunk_length)));
+      chunk_sizes[p]++;
+
+      samples->add(i, sa);
+    }
+
+    for (size_t p = 0; p < chunks; p++) {
+      delete offsets[p];
+    }
+  }
+  if (!keep_suffix) {
+    psascan_private::utils::file_delete(suffix);
+  }
+
+  // Resolve the symbols one chunk at a time
+  unsigned char *text = new unsigned char[chunk_length];
+  for (size_t p = 0; p < chunks; p++) {
+    const long beg = static_cast<long>(p * chunk_length);
+    const long length = std::min(static_cast<long>(chunk_length), static_cast<long>(n) - beg);
+    psascan_private::utils::read_block(input, beg, length, text);
+
+    {
+      em_reader_t<uint40> positions(chunk_filenames[p] + ".pos", chunk_sizes[p]);
+      em_writer_t<unsigned char> symbols(chunk_filenames[p]);
+      for (long j = 0; j < chunk_sizes[p]; j++) {
+        symbols.write(text[positions.read().ull()]);
+      }
+    }
+
+    psascan_private::utils::file_delete(chunk_filenames[p] + ".pos");
+  }
+  delete[] text;
+
+  // Merge the symbols back into the order of the suffix array
+  {
+    em_reader_t<uint8_t> ids(ids_filename, static_cast<long>(n));
+
+    std::vector<em_reader_t<unsigned char>*> symbols(chunks);
+    for (size_t p = 0; p < chunks; p++) {
+      symbols[p] = new em_reader_t<unsigned char>(chunk_filenames[p], chunk_sizes[p]);
+    }
+
+    // The writer double buffers within one stream buffer, as budgeted
+    psascan_private::async_stream_writer<unsigned char> out(bwt, EM_BWT_BUFFER_SIZE);
+    for (size_t i = 0; i < n; i++) {
+      out.write(symbols[ids.read()]->read());
+    }
+
+    for (size_t p = 0; p < chunks; p++) {
+      delete symbols[p];
+    }
+  }
+
+  psascan_private::utils::file_delete(ids_filename);
+  for (size_t p = 0; p < chunks; p++) {
+    psascan_private::utils::file_delete(chunk_filenames[p]);
+  }
+}
+
+#endif
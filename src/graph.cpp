@@ -1,28 +1,211 @@
 // Copyright 2017 Riku Walve
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <iostream>
+#include <thread>
+#include <utility>
 #include <vector>
 #include <string>
 
 #include <sdsl/bit_vectors.hpp>
-#include <sdsl/lcp.hpp>
+#include <sdsl/int_vector.hpp>
 
 #include "index.h"
 #include "interval.h"
 #include "graph.h"
+#include "profile.h"
 
-// TODO: Use a more efficient construction based on FM-index
-sdsl::rrr_vector<127> graph_t::build_first(const std::string &filename, const size_t k) {
-  sdsl::lcp_wt<> lcp;
-  sdsl::construct(lcp, filename.c_str(), 1);
+// Subtrees of the context tree handed out per thread, for load balancing
+#define CONTEXT_SUBTREES_PER_THREAD 16
 
-  sdsl::bit_vector first = sdsl::bit_vector(lcp.size(), false);
-  for (size_t i = 1; i < lcp.size(); i++) {
-    if (lcp[i] < k) {
-      first[i-1] = true;
+// Sets a bit that other threads may be setting bits of the same word in
+static inline void atomic_set(uint64_t *words, const size_t i) {
+  __atomic_fetch_or(words + (i >> 6), static_cast<uint64_t>(1) << (i & 63), __ATOMIC_RELAXED);
+}
+
+// Visits the contexts below the root, which is a context of the given depth
+template<class wt_t, typename visitor_t>
+static void visit_contexts_aux(const index_t<wt_t> &index, const size_t max_depth,
+    const interval_t &root, const size_t root_depth, const visitor_t &visit) {
+  std::vector<uint8_t> symbols;
+  std::vector<interval_t> extensions;
+
+  std::vector<std::pair<interval_t, size_t> > stack;
+  stack.push_back(std::make_pair(root, root_depth));
+  while (!stack.empty()) {
+    const interval_t interval = stack.back().first;
+    const size_t depth = stack.back().second;
+    stack.pop_back();
+
+    visit(interval, depth);
+    if (depth == max_depth) continue;
+
+    const size_t count = index.extensions(interval, &symbols, &extensions);
+    for (size_t i = 0; i < count; i++) {
+      stack.push_back(std::make_pair(extensions[i], depth + 1));
+    }
+  }
+}
+
+// Threads take subtrees from the frontier until it runs out
+template<class wt_t, typename visitor_t>
+static void visit_contexts_thread_code(const index_t<wt_t> &index, const size_t max_depth,
+    const std::vector<interval_t> &frontier, const size_t depth,
+    std::atomic<size_t> *next, const visitor_t &visit) {
+  for (size_t i = (*next)++; i < frontier.size(); i = (*next)++) {
+    visit_contexts_aux(index, max_depth, frontier[i], depth, visit);
+  }
+}
+
+// Visits every distinct context of length at most max_depth using backward
+// search over the FM-index. A context is always visited before the longer
+// contexts it is a suffix of, and by the same thread.
+//
+// The contexts are first expanded breadth-first until there are enough
+// subtrees to keep every thread busy. Each subtree is then searched
+// depth-first, so the stack holds at most sigma contexts per depth. The
+// subtrees cover disjoint ranges of rows.
+template<class wt_t, typename visitor_t>
+static void visit_contexts(const index_t<wt_t> &index, const size_t max_depth, const visitor_t &visit) {
+  const size_t threads_count = static_cast<size_t>(max_threads());
+
+  std::vector<uint8_t> symbols;
+  std::vector<interval_t> extensions;
+
+  std::vector<interval_t> frontier;
+  frontier.push_back(interval_t(0, index.size() - 1));
+
+  size_t depth = 0;
+  while (depth < max_depth && frontier.size() < CONTEXT_SUBTREES_PER_THREAD * threads_count) {
+    std::vector<interval_t> next;
+    for (size_t i = 0; i < frontier.size(); i++) {
+      visit(frontier[i], depth);
+
+      const size_t count = index.extensions(frontier[i], &symbols, &extensions);
+      next.insert(next.end(), extensions.begin(), extensions.begin() + count);
+    }
+
+    frontier.swap(next);
+    depth++;
+  }
+
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < threads_count; t++) {
+    threads.push_back(std::thread(visit_contexts_thread_code<wt_t, visitor_t>, std::cref(index),
+      max_depth, std::cref(frontier), depth, &next, std::cref(visit)));
+  }
+
+  for (size_t t = 0; t < threads.size(); t++) {
+    threads[t].join();
+  }
+}
+
+// Visits the rows of the suffixes shorter than max_depth with their lengths.
+// They end their texts, so their common prefix with the previous row is at
+// most their length, even where the previous row is the same suffix of
+// another text, which no context tells apart from them.
+template<class wt_t, typename visitor_t>
+static void visit_short_suffixes(const index_t<wt_t> &index, const size_t max_depth,
+    const visitor_t &visit) {
+  const std::vector<sa_text_t> &texts = index.texts();
+  for (size_t t = 0; t < texts.size(); t++) {
+    const size_t end = (t + 1 < texts.size()) ? texts[t + 1].position : index.size();
+    size_t row = texts[t].end_row;
+    for (size_t length = 1; length < max_depth && length <= end - texts[t].position; length++) {
+      visit(row, length);
+      row = index.lf(row);
+    }
+  }
+}
+
+// Marks the left boundary of every context
+struct first_visitor_t {
+  uint64_t *first;
+
+  inline void operator()(const interval_t &interval, const size_t) const {
+    atomic_set(first, interval.left);
+  }
+};
+
+// A row is first the left boundary of a context one longer than its common
+// prefix with the previous row. Contexts are visited parents first, and the
+// rows of a subtree belong to one thread, so plain byte writes are enough.
+struct lcp_visitor_t {
+  uint8_t *lcp;
+
+  inline void operator()(const interval_t &interval, const size_t depth) const {
+    const uint8_t value = static_cast<uint8_t>(depth == 0 ? 0 : depth - 1);
+    if (value < lcp[interval.left]) {
+      lcp[interval.left] = value;
+    }
+  }
+};
+
+// Marks the rows where the longest common prefix with the previous row is
+// less than k, using the FM-index instead of an LCP array. The left
+// boundary of every context of length at most k starts a new k-mer, and so
+// does every suffix shorter than k. The suffixes end at the end of their
+// text, like in the constructions that compare them in the text.
+template<class wt_t>
+sdsl::rrr_vector<127> graph_t<wt_t>::build_first(const index_t<wt_t> &index, const size_t k) {
+  phase_t phase("build_first");
+
+  sdsl::bit_vector first = sdsl::bit_vector(index.size() + 1, false);
+
+  first_visitor_t visitor = { first.data() };
+  visit_contexts(index, k, visitor);
+  visit_short_suffixes(index, k, [&first](const size_t row, const size_t) {
+    first[row] = 1;
+  });
+
+  sdsl::rrr_vector<127> rrr(first);
+  sdsl::util::clear(first);
+
+  return rrr;
+}
+
+// The longest common prefix of every row with the previous row, capped at
+// kmax, from the same traversal as build_first
+template<class wt_t>
+sdsl::int_vector<> graph_t<wt_t>::build_lcp(const index_t<wt_t> &index, const size_t kmax) {
+  phase_t phase("build_lcp");
+
+  if (kmax > MAX_STORED_K) {
+    std::cerr << "[E::" << __func__ << "]: Maximum k of " << kmax <<
+      " is over the limit of " << MAX_STORED_K << "!" << std::endl;
+    exit(1);
+  }
+
+  sdsl::int_vector<8> capped(index.size() + 1, static_cast<uint8_t>(kmax));
+
+  lcp_visitor_t visitor = { reinterpret_cast<uint8_t*>(capped.data()) };
+  visit_contexts(index, kmax, visitor);
+  visit_short_suffixes(index, kmax, [&capped](const size_t row, const size_t length) {
+    if (length < capped[row]) {
+      capped[row] = length;
     }
+  });
+
+  sdsl::int_vector<> lcp(capped.size(), 0, sdsl::bits::hi(kmax) + 1);
+  for (size_t i = 0; i < capped.size(); i++) {
+    lcp[i] = capped[i];
   }
 
-  sdsl::util::clear(lcp);
+  return lcp;
+}
+
+// Thresholds a capped LCP array at k, which must not be more than the cap
+template<class wt_t>
+sdsl::rrr_vector<127> graph_t<wt_t>::first_from_lcp(const sdsl::int_vector<> &lcp, const size_t k) {
+  phase_t phase("first_from_lcp");
+
+  sdsl::bit_vector first = sdsl::bit_vector(lcp.size(), false);
+  for (size_t i = 0; i + 1 < lcp.size(); i++) {
+    first[i] = lcp[i] < k;
+  }
 
   sdsl::rrr_vector<127> rrr(first);
   sdsl::util::clear(first);
@@ -30,7 +213,130 @@ sdsl::rrr_vector<127> graph_t::build_first(const std::string &filename, const si
   return rrr;
 }
 
-std::string graph_t::label(const interval_t &node) const {
+template<class wt_t>
+graph_t<wt_t> graph_t<wt_t>::merge(const graph_t &graph, const std::string &kernel_filename,
+    const long ram_use) {
+  const long build_ram_use = ram_use - index_t<wt_t>::ram_use(graph.size(),
+    graph.m_index.sample_density(), graph.m_index.has_psi());
+  return merge(graph, graph_t(kernel_filename, graph.m_k, graph.m_kmax, build_ram_use, nullptr,
+    graph.m_index.sample_density()), kernel_filename);
+}
+
+// Returns the longest common prefix of a row with the previous row, capped
+// at depth, as it was in the graph the row came from
+static inline size_t stored_lcp(const sdsl::int_vector<> &lcp, const sdsl::rrr_vector<127> &first,
+    const size_t i, const size_t depth) {
+  if (!lcp.empty()) {
+    return lcp[i];
+  }
+
+  return first[i] ? 0 : depth;
+}
+
+// Returns the longest common prefix of a row with the previous row, capped
+// at depth. The suffixes end at the end of their text, like in lcp.
+template<class wt_t>
+static inline size_t compared_lcp(const index_t<wt_t> &index, const size_t row,
+    const size_t depth, std::vector<uint8_t> *previous, std::vector<uint8_t> *current) {
+  const size_t length = std::min(index.extract(row - 1, depth, previous->data()),
+    index.extract(row, depth, current->data()));
+
+  size_t l = 0;
+  while (l < length && (*previous)[l] == (*current)[l])
+    l++;
+  return l;
+}
+
+template<class wt_t>
+graph_t<wt_t> graph_t<wt_t>::merge(const graph_t &a, const graph_t &b, const std::string &b_kernel_filename) {
+  if (a.m_k != b.m_k || a.m_kmax != b.m_kmax) {
+    std::cerr << "[E::" << __func__ << "]: Graphs with different k can not be merged!" << std::endl;
+    exit(1);
+  }
+
+  const std::vector<uint64_t> ranks = a.m_index.insertion_ranks(b_kernel_filename,
+    b.m_index.texts());
+  index_t<wt_t> merged(a.m_index, b.m_index, ranks, b_kernel_filename + ".bwt");
+
+  const size_t n = merged.size();
+  std::cerr << "[V::" << __func__ << "]: " << b.size() << " symbols added to " <<
+    a.size() << std::endl;
+
+  phase_t phase("merge_boundaries");
+
+  // The stored LCP array is kept up to date if there is one
+  const size_t depth = (a.m_kmax > 0) ? a.m_kmax : a.m_k;
+  sdsl::bit_vector first(n + 1, false);
+  sdsl::int_vector<> lcp;
+  if (a.m_kmax > 0) {
+    lcp = sdsl::int_vector<>(n + 1, a.m_kmax, a.m_lcp.width());
+  }
+
+  std::vector<uint8_t> previous(depth), current(depth);
+
+  // Rows that were adjacent in either graph keep their boundaries, so only
+  // the rows next to an inserted row are compared. The runs of rows of a
+  // between the inserted rows are carried over, the first bits a word at a
+  // time.
+  size_t i = 0;
+  for (size_t j = 0; j <= ranks.size(); j++) {
+    // The rows of a in [i, end) are followed by the j-th row of b
+    const size_t end = (j < ranks.size()) ? ranks[j] : a.size();
+    if (i < end) {
+      const size_t l = (j > 0) ? compared_lcp(merged, i + j, depth, &previous, &current) : 0;
+      first[i + j] = (l < a.m_k);
+      if (a.m_kmax > 0) {
+        lcp[i + j] = l;
+      }
+
+      for (size_t p = i + 1; p < end; p += 64) {
+        const uint8_t length = static_cast<uint8_t>(std::min<size_t>(64, end - p));
+        first.set_int(p + j, a.m_first.get_int(p, length), length);
+      }
+      if (a.m_kmax > 0) {
+        for (size_t p = i + 1; p < end; p++) {
+          lcp[p + j] = a.m_lcp[p];
+        }
+      }
+      i = end;
+    }
+
+    if (j < ranks.size()) {
+      const size_t row = ranks[j] + j;
+      size_t l = 0;
+      if (row > 0 && j > 0 && ranks[j - 1] == ranks[j]) {
+        l = stored_lcp(b.m_lcp, b.m_first, j, depth);
+      } else if (row > 0) {
+        l = compared_lcp(merged, row, depth, &previous, &current);
+      }
+
+      first[row] = (l < a.m_k);
+      if (a.m_kmax > 0) {
+        lcp[row] = l;
+      }
+    }
+  }
+
+  // The text is kept if the graph appended to kept it
+  packed_text_t text = a.m_text.empty() ? packed_text_t() :
+    packed_text_t(b_kernel_filename, a.m_text);
+
+  return graph_t(a.m_k, std::move(merged), sdsl::rrr_vector<127>(first),
+    a.m_kmax, std::move(lcp), std::move(text));
+}
+
+template<class wt_t>
+bool graph_t<wt_t>::label(const interval_t &node, char *symbols) const {
+  // Every row of the node starts with the label. Past a separator, the
+  // walk below keeps the symbol before it, so the text does the same.
+  if (!m_text.empty()) {
+    const size_t length = m_text.extract(m_index.sa(node.left), m_k, symbols);
+    const size_t end = static_cast<size_t>(std::find(symbols, symbols + length, MARKER) - symbols);
+    std::fill(symbols + end, symbols + m_k, (end == 0) ? '\0' : symbols[end - 1]);
+
+    return true;
+  }
+
   interval_t interval = node;
   uint8_t c = '\0';
   for (size_t i = 0; i < m_k; i++) {
@@ -41,41 +347,38 @@ std::string graph_t::label(const interval_t &node) const {
     #endif
 
     interval = m_index.inverse_lf(interval, &c);
-    m_buffer[i] = static_cast<char>(c);
+    symbols[i] = static_cast<char>(c);
 
     if (c == MARKER) {
-      return "";
+      return false;
     }
   }
 
-  return std::string(m_buffer, m_k);
+  return true;
 }
 
-std::vector<interval_t> graph_t::distinct_kmers(const size_t solid) const {
+template<class wt_t>
+std::vector<interval_t> graph_t<wt_t>::distinct_kmers(const size_t solid) const {
   std::vector<interval_t> kmers;
   for (size_t i = 1; i <= m_first_rs.rank(m_first.size()); i++) {
-    const size_t start = m_first_ss.select(i);
-    const size_t end = m_first_ss.select(i + 1) - 1;
-
-    if ((end - start) + 1 >= solid) {
-      kmers.push_back(interval_t(start, end));
+    const interval_t node = kmer(i);
+    if (frequency(node) >= solid) {
+      kmers.push_back(node);
     }
   }
   return kmers;
 }
 
-interval_t graph_t::follow_edge(const interval_t &node, const uint8_t c) const {
+template<class wt_t>
+interval_t graph_t<wt_t>::follow_edge(const interval_t &node, const uint8_t c) const {
   // First find the inteval e corresponding to c1 .. ck+1
   const interval_t e = m_index.extend(node, c);
+  if (e.empty()) {
+    return e;
+  }
 
-  if (m_first[e.left] && (e.right == m_index.size()+1 || m_first[e.right+1]))
-    return interval_t(e.left, e.right);
-
-  // Take interval inside it corresponding to c2 .. ck+1
-  const size_t start = m_first[e.left] ? e.left : m_first_ss.select(m_first_rs.rank(e.left));
-  const size_t end = (e.right == m_index.size()) ? e.right : m_first_ss.select(m_first_rs.rank(e.right) + 1) - 1;
-
-  return interval_t(start, end);
+  // The k-mer c1 .. ck is the node holding all of it
+  return kmer(m_first_rs.rank(e.left + 1));
 }
 
 // std::vector<interval_t> graph_t::incoming(const interval_t &node, const size_t solid) const {
@@ -99,53 +402,49 @@ interval_t graph_t::follow_edge(const interval_t &node, const uint8_t c) const {
 //   return nodes;
 // }
 
-// TODO: These two implementations are super dumb and ineffiecient, but accurate
-std::vector<interval_t> graph_t::incoming(const interval_t &node, const size_t solid) const {
-  std::vector<interval_t> edges;
-  for (size_t i = node.left; i <= node.right; i++) {
-    const size_t lf = m_index.lf(i);
-    if (lf == 0) continue;
-
-    const size_t rank = m_first_rs.rank(lf+1);
+template<class wt_t>
+size_t graph_t<wt_t>::incoming(const interval_t &node, interval_t *nodes,
+    const size_t solid) const {
+  m_index.extend_all(node, nodes);
 
-    const size_t left = m_first_ss.select(rank);
-    const size_t right = m_first_ss.select(rank + 1) - 1;
+  // Each preceding symbol leads to a different node. The nodes are written
+  // over the extensions, which are indexed by code, so never ahead of them.
+  size_t count = 0;
+  for (size_t c = 0; c < m_index.sigma(); c++) {
+    if (nodes[c].empty() || m_index.decode(c) == MARKER) continue;
 
-    const interval_t n = interval_t(left, right);
+    const interval_t n = kmer(m_first_rs.rank(nodes[c].left + 1));
     if (frequency(n) >= solid) {
-      bool in = false;
-      for (size_t j = 0; j < edges.size(); j++) {
-        if (edges[j] == n) in = true;
-      }
-      if (!in) edges.push_back(n);
+      nodes[count++] = n;
     }
   }
 
-  return edges;
+  return count;
 }
 
-std::vector<interval_t> graph_t::outgoing(const interval_t &node, const size_t solid) const {
-  std::vector<interval_t> edges;
-  for (size_t i = node.left; i <= node.right; i++) {
-    const size_t ilf = m_index.inverse_lf(i);
-    if (ilf == 0) continue;
+template<class wt_t>
+size_t graph_t<wt_t>::outgoing(const interval_t &node, interval_t *nodes,
+    const size_t solid) const {
+  size_t count = 0;
 
-    const size_t rank = m_first_rs.rank(ilf+1);
-
-    const size_t left = m_first_ss.select(rank);
-    const size_t right = m_first_ss.select(rank + 1) - 1;
+  // The rows following the node are between the first and the last of them
+  uint8_t c = MARKER;
+  const interval_t rows = m_index.inverse_lf(node, &c);
+  if (c == MARKER) {
+    return count;
+  }
 
-    const interval_t n = interval_t(left, right);
-    if (frequency(n) >= solid) {
-      bool in = false;
-      for (size_t j = 0; j < edges.size(); j++) {
-        if (edges[j] == n) in = true;
-      }
-      if (!in) edges.push_back(n);
+  // The nodes in between follow the node if one of their rows is preceded
+  // by its first symbol
+  const size_t last = m_first_rs.rank(rows.right + 1);
+  for (size_t r = m_first_rs.rank(rows.left + 1); r <= last; r++) {
+    const interval_t n = kmer(r);
+    if (frequency(n) >= solid && !m_index.extend(n, c).empty()) {
+      nodes[count++] = n;
     }
-
-    // i += right - ilf + 1;
   }
 
-  return edges;
+  return count;
 }
+
+INSTANTIATE_BACKENDS(graph_t)
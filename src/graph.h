@@ -3,50 +3,78 @@
 #ifndef WANDA_GRAPH_H_
 #define WANDA_GRAPH_H_
 
+#include <utility>
 #include <vector>
 #include <string>
 
 #include <sdsl/bit_vectors.hpp>
 
+#include "backend.h"
+#include "checkpoint.h"
+#include "container.h"
 #include "index.h"
 #include "interval.h"
+#include "packed_text.h"
+#include "profile.h"
 
 #define MARKER '$'
 
 #define frequency(n) ((n.right - n.left) + 1)
 
-class graph_t {
-public:
-  graph_t(const std::string &kernel_filename, const size_t k) :
-      m_k(k), m_index(index_t(kernel_filename)) {
-    m_buffer = new char[k];
+// Largest k the capped LCP array can be stored for
+#define MAX_STORED_K 255
 
-    m_first = build_first(kernel_filename, k);
-    m_first_ss = sdsl::select_support_rrr<1, 127>(&m_first);
-    m_first_rs = sdsl::rank_support_rrr<1, 127>(&m_first);
+// Most neighbours a node can have in either direction, one for each symbol
+#define MAX_DEGREE 256
+
+// The backend of a stored graph. Graphs in separate files always use the
+// Huffman shaped tree over RRR bitvectors.
+static inline backend_t stored_backend(const std::string &base) {
+  if (!container_t::exists(base + ".wanda")) {
+    return BACKEND_HUFF_RRR;
   }
 
-  graph_t(const size_t k, const index_t index, const sdsl::rrr_vector<127> first) :
-      m_k(k), m_index(index), m_first(first) {
-    m_buffer = new char[k];
+  const container_t container(base + ".wanda");
+  return static_cast<backend_t>(container.backend());
+}
 
-    m_first_ss = sdsl::select_support_rrr<1, 127>(&m_first);
-    m_first_rs = sdsl::rank_support_rrr<1, 127>(&m_first);
+// De Bruijn graph over the FM-index with the BWT represented by wt_t
+template<class wt_t>
+class graph_t {
+public:
+  // If kmax is given, the longest common prefixes are kept up to it, so that
+  // the graph can be changed to any order up to kmax without the text. With
+  // a checkpoint, the phases completed by an earlier run are skipped. If psi
+  // is set, the index stores Ψ, see index_t.
+  graph_t(const std::string &kernel_filename, const size_t k, const size_t kmax = 0,
+      const long ram_use = DEFAULT_RAM_USE, checkpoint_t *checkpoint = nullptr,
+      const size_t sample_density = SA_SAMPLE_DENSITY, const bool psi = false) :
+      graph_t(kernel_filename, k, kmax, ram_use, checkpoint, sample_density, psi,
+        sdsl::bit_vector()) {}
+
+  // Takes the index and bitvector by value, so that callers can move them in
+  graph_t(const size_t k, index_t<wt_t> index, sdsl::rrr_vector<127> first,
+      const size_t kmax = 0, sdsl::int_vector<> lcp = sdsl::int_vector<>(),
+      packed_text_t text = packed_text_t()) :
+      m_k(k), m_index(std::move(index)), m_first(std::move(first)),
+      m_kmax(kmax), m_lcp(std::move(lcp)), m_text(std::move(text)) {
+    build_supports();
   }
 
   // Copy constructor
   graph_t(const graph_t& graph) :
-      m_k(graph.m_k), m_index(graph.m_index), m_first(graph.m_first) {
-    m_buffer = new char[m_k];
+      m_k(graph.m_k), m_index(graph.m_index), m_first(graph.m_first),
+      m_kmax(graph.m_kmax), m_lcp(graph.m_lcp), m_text(graph.m_text) {
+    build_supports();
   }
 
-  // Move constructor
+  // Move constructor, the supports are rebound to the moved bitvector
   graph_t(graph_t&& graph) noexcept :
-      m_k(graph.m_k), m_index(graph.m_index), m_first(graph.m_first) {
-    m_buffer = new char[m_k];
-
-    // Invalidate other graph here
-    // sdsl::util::clear(graph.m_first);
+      m_k(graph.m_k), m_index(std::move(graph.m_index)), m_first(std::move(graph.m_first)),
+      m_first_ss(std::move(graph.m_first_ss)), m_first_rs(std::move(graph.m_first_rs)),
+      m_kmax(graph.m_kmax), m_lcp(std::move(graph.m_lcp)), m_text(std::move(graph.m_text)) {
+    m_first_ss.set_vector(&m_first);
+    m_first_rs.set_vector(&m_first);
   }
 
   // Copy assignment operator
@@ -58,22 +86,56 @@ public:
 
   // Move assignment operator
   graph_t& operator=(graph_t&& graph) noexcept {
+    if (this == &graph) {
+      return *this;
+    }
+
     m_k = graph.m_k;
-    m_index = graph.m_index;
-    m_first = graph.m_first;
+    m_index = std::move(graph.m_index);
+    m_first = std::move(graph.m_first);
 
-    // Invalidate other graph here
+    m_first_ss = std::move(graph.m_first_ss);
+    m_first_rs = std::move(graph.m_first_rs);
+    m_first_ss.set_vector(&m_first);
+    m_first_rs.set_vector(&m_first);
 
-    return *this;
-  }
+    m_kmax = graph.m_kmax;
+    m_lcp = std::move(graph.m_lcp);
+    m_text = std::move(graph.m_text);
 
-  ~graph_t() noexcept {
-    delete[] m_buffer;
+    return *this;
   }
 
-  // Loads a graph from a file
+  // Loads a graph from a file. Graphs stored in separate .bwt, .sa and
+  // .first files are still read when there is no .wanda file.
   static graph_t load(const std::string &base) {
-    index_t index = index_t::load(base);
+    phase_t phase("load");
+
+    if (container_t::exists(base + ".wanda")) {
+      const container_t container(base + ".wanda");
+      if (container.backend() != backend_traits<wt_t>::id) {
+        std::cerr << "[E::" << __func__ << "]: \"" << base << "\" was built with the " <<
+          backend_name(static_cast<backend_t>(container.backend())) << " backend, not " <<
+          backend_name(backend_traits<wt_t>::id) << "!" << std::endl;
+        exit(1);
+      }
+
+      sdsl::rrr_vector<127> first;
+      container.load(SECTION_FIRST, &first);
+
+      sdsl::int_vector<> lcp;
+      if (container.kmax() > 0) {
+        container.load(SECTION_LCP, &lcp);
+      }
+
+      packed_text_t text;
+      container.load(SECTION_TEXT, &text);
+
+      return graph_t(container.k(), index_t<wt_t>::load(container), std::move(first),
+        container.kmax(), std::move(lcp), std::move(text));
+    }
+
+    index_t<wt_t> index = index_t<wt_t>::load(base);
 
     size_t k;
     sdsl::rrr_vector<127> first;
@@ -95,36 +157,86 @@ public:
       std::cerr << std::endl;
     #endif
 
-    return graph_t(k, index, first);
+    return graph_t(k, std::move(index), std::move(first));
   }
 
-  // Stores the graph to a file
-  void store_to_file(const std::string &base) const {
-    m_index.store_to_file(base);
+  // Smallest RAM budget the graph of a text of length n can be constructed
+  // in, including the k-mer boundaries and the capped LCP array
+  static long min_ram_use(const size_t n, const size_t kmax = 0,
+      const size_t sample_density = SA_SAMPLE_DENSITY, const bool psi = false) {
+    const long boundaries = (kmax > 0) ? static_cast<long>(2 * n) : static_cast<long>(n / 4);
+    return std::max(index_t<wt_t>::min_ram_use(n, sample_density, psi),
+      index_t<wt_t>::ram_use(n, sample_density, psi) + boundaries);
+  }
 
-    std::ofstream out(base + ".first");
-    if (out.good()) {
-      out.write(reinterpret_cast<const char*>(&m_k), sizeof(m_k));
-      m_first.serialize(out);
-    } else {
-      std::cerr << "[E::" << __func__ << "]: Unable to write to \"" << base + ".first\"!" << std::endl;
+  // RAM used by appending a text of length m to a graph of a text of length
+  // n: both graphs, the merged graph, the insertion ranks of the appended
+  // text and the text itself. Ψ is stored in the merged graph if psi is set.
+  static long merge_ram_use(const size_t n, const size_t m, const size_t kmax = 0,
+      const size_t sample_density = SA_SAMPLE_DENSITY, const bool psi = false) {
+    const long boundaries = (kmax > 0) ? static_cast<long>(2 * (n + m)) :
+      static_cast<long>((n + m) / 4);
+    return index_t<wt_t>::ram_use(n, sample_density, psi) +
+      index_t<wt_t>::ram_use(m, sample_density) +
+      index_t<wt_t>::ram_use(n + m, sample_density, psi) + boundaries +
+      static_cast<long>(m * (sizeof(uint64_t) + 1));
+  }
+
+  // RAM used by appending a text of length m to the graph, with the merged
+  // packed text if the graph keeps one. Without the graph of the text, it is
+  // first built next to this graph.
+  long append_ram_use(const size_t m, const bool build) const {
+    const size_t n = size();
+    const size_t density = m_index.sample_density();
+    long required = merge_ram_use(n, m, m_kmax, density, m_index.has_psi()) +
+      (m_text.empty() ? 0 : static_cast<long>((n + m) / 4));
+    if (build) {
+      required = std::max(required, index_t<wt_t>::ram_use(n, density, m_index.has_psi()) +
+        min_ram_use(m, m_kmax, density));
     }
+    return required;
+  }
+
+  // Appends a text to the text of a graph. Only the appended text is suffix
+  // sorted, and the k-mer boundaries are only recomputed where the rows of
+  // the two texts interleave. The graph of the text is built in what the
+  // budget leaves next to the graph.
+  static graph_t merge(const graph_t &graph, const std::string &kernel_filename,
+    const long ram_use = DEFAULT_RAM_USE);
+
+  // Merges the graph of a text into the graph of the text before it. Both
+  // graphs must have the same k and maximum k.
+  static graph_t merge(const graph_t &a, const graph_t &b, const std::string &b_kernel_filename);
+
+  // Stores the graph to a single .wanda file
+  void store_to_file(const std::string &base) const {
+    phase_t phase("store");
+
+    container_writer_t container(base + ".wanda", m_k, m_kmax, m_index.size(),
+      backend_traits<wt_t>::id, m_index.has_psi() ? CONTAINER_PSI : 0);
+    m_index.store(&container);
+    container.store(SECTION_FIRST, m_first);
+    container.store(SECTION_LCP, m_lcp);
+    container.store(SECTION_TEXT, m_text);
+  }
+
+  // Keeps a packed copy of the text the graph was built from, so that
+  // labels are read from the text instead of the index
+  void pack_text(const std::string &kernel_filename) {
+    phase_t phase("pack_text");
+    m_text = packed_text_t(kernel_filename);
   }
 
+  // Changes the order of the graph. This is a linear scan if the graph was
+  // built with a maximum k of at least k, otherwise the index is searched.
   void change_k(const size_t k) {
     if (k == m_k) {
       return;
     }
 
-    std::cerr << "[E::" << __func__ << "]: Not yet implemented!" << std::endl;
-    exit(1);
-
     m_k = k;
-
-    // TODO: Implement build_first() without text
-    m_first = build_first("", k);
-    m_first_ss = sdsl::select_support_rrr<1, 127>(&m_first);
-    m_first_rs = sdsl::rank_support_rrr<1, 127>(&m_first);
+    m_first = (k <= m_kmax) ? first_from_lcp(m_lcp, k) : build_first(m_index, k);
+    build_supports();
   }
 
   inline size_t size() const {
@@ -134,23 +246,60 @@ public:
   // All distinct nodes with a minimum frequency
   std::vector<interval_t> distinct_kmers(const size_t solid = 0) const;
 
-  // Returns the label of a node (i.e. the "content" of the corresponding kmer)
-  std::string label(const interval_t &node) const;
+  // The queries below only read the graph, so any number of threads can
+  // share one. The forms writing to a buffer do not allocate: a label takes
+  // k symbols, and the neighbours of a node at most sigma() nodes, which is
+  // at most MAX_DEGREE.
+
+  // Most neighbours a node can have in either direction
+  inline size_t sigma() const {
+    return m_index.sigma();
+  }
+
+  // Writes the label of a node (i.e. the "content" of the corresponding
+  // kmer) to k symbols. Returns false if it runs into a separator.
+  bool label(const interval_t &node, char *symbols) const;
+
+  // Returns the label of a node, or an empty string if it runs into a
+  // separator
+  std::string label(const interval_t &node) const {
+    std::string symbols(m_k, '\0');
+    return label(node, &symbols[0]) ? symbols : "";
+  }
+
+  // Writes all the nodes which have an outgoing edge to a node, returning
+  // their number. The buffer is also used for the extensions of the node,
+  // so it needs room for sigma() nodes even if fewer are found.
+  size_t incoming(const interval_t &node, interval_t *nodes, const size_t solid = 0) const;
+
+  // Writes all the nodes which have an incoming edge from a node, returning
+  // their number
+  size_t outgoing(const interval_t &node, interval_t *nodes, const size_t solid = 0) const;
 
   // Returns all the nodes which have an outgoing edge to a node
-  std::vector<interval_t> incoming(const interval_t &node, const size_t solid = 0) const;
+  std::vector<interval_t> incoming(const interval_t &node, const size_t solid = 0) const {
+    std::vector<interval_t> nodes(sigma());
+    nodes.resize(incoming(node, nodes.data(), solid));
+    return nodes;
+  }
 
   // Returns all the nodes which have an incoming edge from a node
-  std::vector<interval_t> outgoing(const interval_t &node, const size_t solid = 0) const;
+  std::vector<interval_t> outgoing(const interval_t &node, const size_t solid = 0) const {
+    std::vector<interval_t> nodes(sigma());
+    nodes.resize(outgoing(node, nodes.data(), solid));
+    return nodes;
+  }
 
   // The in-degree of a node
   inline size_t outdegree(const interval_t &node, const size_t solid = 0) const {
-    return outgoing(node, solid).size();
+    interval_t nodes[MAX_DEGREE];
+    return outgoing(node, nodes, solid);
   }
 
   // The out-degree of a node
   inline size_t indegree(const interval_t &node, const size_t solid = 0) const {
-    return incoming(node, solid).size();
+    interval_t nodes[MAX_DEGREE];
+    return incoming(node, nodes, solid);
     // const std::vector<uint8_t> symbols = m_index.interval_symbols(node.left, node.right);
     //
     // size_t count = 0;
@@ -165,11 +314,17 @@ public:
 
   // Returns all occurrences of a kmer in the text
   std::vector<size_t> occurrences(const interval_t &node) const {
-    std::vector<size_t> occurrences;
-    for (size_t j = node.left; j <= node.right; j++) {
-      occurrences.push_back(m_index.sa(j));
-    }
-    return occurrences;
+    std::vector<uint64_t> positions;
+    m_index.locate(std::vector<interval_t>(1, node), &positions, 1);
+    return std::vector<size_t>(positions.begin(), positions.end());
+  }
+
+  // Occurrences of many kmers, one after the other in the order of the
+  // nodes, using every thread
+  std::vector<uint64_t> locate(const std::vector<interval_t> &nodes) const {
+    std::vector<uint64_t> positions;
+    m_index.locate(nodes, &positions);
+    return positions;
   }
 
   inline size_t rank(const interval_t &node) const {
@@ -181,24 +336,81 @@ public:
   }
 
 private:
+  // The index construction marks the k-mers in the same pass when it can,
+  // otherwise they are found from the index
+  graph_t(const std::string &kernel_filename, const size_t k, const size_t kmax,
+      const long ram_use, checkpoint_t *checkpoint, const size_t sample_density, const bool psi,
+      sdsl::bit_vector &&first) :
+      m_k(k), m_index(kernel_filename, ram_use, k, (kmax > 0) ? nullptr : &first, checkpoint,
+        sample_density, psi),
+      m_kmax(kmax) {
+    if (kmax > 0) {
+      if (checkpoint != nullptr && checkpoint->done("lcp")) {
+        checkpoint->load("lcp", "lcp", &m_lcp);
+      } else {
+        m_lcp = build_lcp(m_index, kmax);
+        if (checkpoint != nullptr) {
+          checkpoint->store("lcp", "lcp", m_lcp);
+          checkpoint->commit("lcp", { "lcp" });
+        }
+      }
+      m_first = first_from_lcp(m_lcp, k);
+    } else if (checkpoint != nullptr && checkpoint->done("first")) {
+      checkpoint->load("first", "first", &m_first);
+    } else {
+      m_first = first.empty() ? build_first(m_index, k) : sdsl::rrr_vector<127>(first);
+      sdsl::util::clear(first);
+      if (checkpoint != nullptr) {
+        checkpoint->store("first", "first", m_first);
+        checkpoint->commit("first", { "first" });
+        checkpoint->discard("boundaries");
+      }
+    }
+
+    build_supports();
+  }
+
+  // The node of the k-mer with the given rank, counting from 1. The last
+  // k-mer ends at the last row, as there is no next one to select.
+  inline interval_t kmer(const size_t rank) const {
+    const size_t right = (rank == m_first_rs.rank(size())) ? size() - 1 :
+      m_first_ss.select(rank + 1) - 1;
+    return interval_t(m_first_ss.select(rank), right);
+  }
+
+  void build_supports() {
+    phase_t phase("rank_select");
+    m_first_ss = sdsl::select_support_rrr<1, 127>(&m_first);
+    m_first_rs = sdsl::rank_support_rrr<1, 127>(&m_first);
+  }
+
   // Follows an edge in the graph from a node to a node
   interval_t follow_edge(const interval_t &node, uint8_t c) const;
 
-  static sdsl::rrr_vector<127> build_first(const std::string &filename, const size_t k);
+  static sdsl::rrr_vector<127> build_first(const index_t<wt_t> &index, const size_t k);
+  static sdsl::int_vector<> build_lcp(const index_t<wt_t> &index, const size_t kmax);
+  static sdsl::rrr_vector<127> first_from_lcp(const sdsl::int_vector<> &lcp, const size_t k);
 
 private:
   size_t m_k;
 
   // FM-m_index
-  index_t m_index;
+  index_t<wt_t> m_index;
 
-  // Bitvector marking starting positions for k-mers
+  // Bitvector marking starting positions for k-mers, which are the rows
+  // whose longest common prefix with the previous row is less than k. The
+  // suffixes end at the end of their text on every construction path.
   sdsl::rrr_vector<127> m_first;
   sdsl::select_support_rrr<1, 127> m_first_ss;
   sdsl::rank_support_rrr<1, 127> m_first_rs;
 
-  // Buffer for kmer labels
-  char *m_buffer;
+  // Longest common prefixes with the previous row capped at kmax, empty if
+  // kmax is zero
+  size_t m_kmax;
+  sdsl::int_vector<> m_lcp;
+
+  // Copy of the text for reading labels, empty if it was not kept
+  packed_text_t m_text;
 };
 
 #endif
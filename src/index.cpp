@@ -1,12 +1,46 @@
 // Copyright 2017 Riku Walve
 
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <sdsl/bit_vectors.hpp>
 #include <sdsl/wavelet_trees.hpp>
 
+#include "psascan_src/psascan.h"
+#include "psascan_src/inmem_psascan_src/inmem_psascan.h"
+
+#include "bwt_stream.h"
+#include "em_bwt.h"
 #include "index.h"
 #include "interval.h"
+#include "lcp.h"
+#include "profile.h"
+
+// Peak memory of in-memory pSAscan per input symbol, including the text
+#define INMEM_RAM_PER_SYMBOL 10
+
+// Memory pSAscan needs for the buffers of each thread, and for the blocks
+// to be of useful size
+#define PSASCAN_RAM_PER_THREAD (14L << 20)
+#define PSASCAN_MIN_BLOCK_RAM (16L << 20)
+
+// Size of the wavelet tree, and of its construction, per symbol in bits.
+// Huffman shaped trees over DNA take a little over 2 bits per symbol.
+#define WT_BITS_PER_SYMBOL 6
+
+// Size of psi_t per symbol in bits, which is 2 + log(sigma) for the sparse
+// bitvector and a little for its select support, if it is stored
+#define PSI_BITS_PER_SYMBOL 5
+#define PSI_BITS(psi) ((psi) ? PSI_BITS_PER_SYMBOL : 0)
+
+// Rows whose LF walks are advanced in turns by one thread of locate, and
+// the fewest rows worth a thread of their own
+#define LOCATE_BATCH 32
+#define LOCATE_MIN_THREAD_ROWS (1 << 14)
 
 static inline size_t filelength(FILE * fp) {
   fseek(fp, 0, SEEK_END);
@@ -15,79 +49,640 @@ static inline size_t filelength(FILE * fp) {
   return file_len;
 }
 
-// Construct BWT from input file and sa5 file
-static void stream_bwt(const std::string &input, const std::string &suffix,
-    const std::string &bwt, sdsl::int_vector<> *samples) {
-  // Load input file to memory
-  FILE *in = fopen(input.c_str(), "r");
-  const size_t n = filelength(in);
-  char *in_buffer = new char[n];
-  fread(in_buffer, sizeof(char), n, in);
-  fclose(in);
+// Construct suffix array with pSAscan, streaming it directly into the BWT,
+// SA samples and k-mer boundaries instead of through a .sa5 file
+static void stream_bwt(const std::string &input, const unsigned char *text, const size_t n,
+    const long ram_use, const std::string &bwt, sa_samples_builder_t *samples,
+    const size_t k, sdsl::bit_vector *first) {
+  const std::string suffix = input + ".sa5";
+
+  phase_t phase("stream_bwt");
+  bwt_stream_t stream(text, n, bwt, samples, k, first, static_cast<size_t>(max_threads()));
+  psascan_private::pSAscan(input, &stream, suffix, suffix, ram_use, max_threads(), false);
+}
+
+// Marks the sampled rows and the rows starting a new k-mer in the rows
+// [beg, end) of the suffix array, collecting the sampled positions in order
+template<typename saidx_t>
+static void scan_sa_aux(const unsigned char *text, const size_t n, const saidx_t *sa,
+    const size_t beg, const size_t end, sa_samples_builder_t *samples,
+    std::vector<uint64_t> *positions, const size_t k, sdsl::bit_vector *first) {
+  for (size_t i = beg; i < end; i++) {
+    const size_t sa_i = static_cast<size_t>(sa[i]);
+    samples->mark(i, sa_i);
+    if (samples->sampled(sa_i)) {
+      positions->push_back(sa_i);
+    }
+
+    if (first != nullptr) {
+      (*first)[i] = (i == 0) || (lcp(text, n, static_cast<size_t>(sa[i - 1]), sa_i, k) < k);
+    }
+  }
+}
+
+// Construct the BWT and suffix array together with in-memory pSAscan, which
+// avoids the random accesses to the text needed by stream_bwt
+template<typename saidx_t>
+static void inmem_bwt(unsigned char *text, const size_t n, const std::string &bwt,
+    sa_samples_builder_t *samples, const size_t k, sdsl::bit_vector *first) {
+  // pSAscan stores the suffix array followed by the BWT
+  unsigned char *sa_bwt = new unsigned char[n * (sizeof(saidx_t) + 1)];
+
+  long i0 = 0;
+  {
+    phase_t phase("inmem_psascan");
+    psascan_private::inmem_psascan_private::inmem_psascan<saidx_t>(text,
+      static_cast<long>(n), sa_bwt, max_threads(), true, false, NULL, -1,
+      0, 0, 0, "", NULL, &i0);
+  }
+
+  const saidx_t *sa = reinterpret_cast<const saidx_t*>(sa_bwt);
+  unsigned char *bwt_buffer = sa_bwt + n * sizeof(saidx_t);
 
-  // Open sa5 file for reading
-  FILE *suf = fopen(suffix.c_str(), "rb");
-  uint8_t *buffer = new uint8_t[5];
+  // pSAscan leaves a zero at the row of the whole text, we use the cyclic BWT
+  bwt_buffer[i0] = text[n - 1];
 
-  std::ofstream bwt_stream(bwt.c_str());
-  for (size_t i = 0; i < n; i++) {
-    // TODO: Read 5*N characters at a time
-    fread(buffer, sizeof(char), 5, suf);
+  // Scan the suffix array in parallel. The ranges are aligned to 64 rows so
+  // that no two threads write to the same word of the bitvectors.
+  phase_t phase("scan_sa");
+  const size_t threads_count = static_cast<size_t>(max_threads());
+  const size_t range_size = (((n + threads_count - 1) / threads_count) + 63) & ~static_cast<size_t>(63);
+  const size_t ranges = (n + range_size - 1) / range_size;
 
-    // Shift the char into position
-    int64_t sa = static_cast<int64_t>(buffer[0]);
-    sa |= (static_cast<int64_t>(buffer[1])) << 8;
-    sa |= (static_cast<int64_t>(buffer[2])) << 16;
-    sa |= (static_cast<int64_t>(buffer[3])) << 24;
-    sa |= (static_cast<int64_t>(buffer[4])) << 32;
+  std::vector<std::vector<uint64_t> > positions(ranges);
+  std::thread **threads = new std::thread*[ranges];
+  for (size_t t = 0; t < ranges; t++) {
+    const size_t beg = t * range_size;
+    const size_t end = std::min(n, beg + range_size);
+    threads[t] = new std::thread(scan_sa_aux<saidx_t>, text, n, sa, beg, end,
+      samples, &positions[t], k, first);
+  }
 
-    // TODO: Not load to memory, but still random accesses?
-    bwt_stream << (in_buffer[sa == 0 ? n - 1 : sa - 1]);
+  for (size_t t = 0; t < ranges; t++) threads[t]->join();
+  for (size_t t = 0; t < ranges; t++) delete threads[t];
+  delete[] threads;
 
-    if ((i % SA_SAMPLE_DENSITY) == 0) {
-      (*samples)[i / SA_SAMPLE_DENSITY] = sa;
+  // The positions of the ranges are in row order one after the other
+  for (size_t t = 0; t < ranges; t++) {
+    for (size_t j = 0; j < positions[t].size(); j++) {
+      samples->push(positions[t][j] / samples->density());
     }
+    std::vector<uint64_t>().swap(positions[t]);
   }
 
-  bwt_stream.close();
+  sdsl::osfstream out(bwt, std::ios::binary | std::ios::trunc | std::ios::out);
+  out.write(reinterpret_cast<const char*>(bwt_buffer), static_cast<std::streamsize>(n));
+  out.close();
 
-  fclose(suf);
+  delete[] sa_bwt;
+}
 
-  delete[] buffer;
-  delete[] in_buffer;
+static unsigned char *load_text(const std::string &filename, const size_t n) {
+  unsigned char *text = new unsigned char[n];
+  psascan_private::utils::read_block(filename, 0, static_cast<long>(n), text);
+  return text;
 }
 
-index_t::index_t(const std::string &kernel_filename) {
-  const std::string suffix_filename = kernel_filename + ".sa5";
-  const std::string bwt_filename = kernel_filename + ".bwt";
+template<class wt_t>
+index_t<wt_t>::index_t(const std::string &kernel_filename, const long ram_use,
+    const size_t k, sdsl::bit_vector *first, checkpoint_t *checkpoint,
+    const size_t sample_density, const bool psi) {
+  // The k-mer boundaries need the text, so they are only computed in the
+  // passes that have it in memory
+  if (first != nullptr) {
+    sdsl::util::clear(*first);
+  }
+
+  if (checkpoint == nullptr) {
+    load_bwt(build_bwt(kernel_filename, ram_use, k, first, nullptr, sample_density), psi);
+    return;
+  }
+
+  if (checkpoint->done("index")) {
+    sdsl::int_vector<8> alphabet;
+    checkpoint->load("index", "bwt", &m_tree);
+    checkpoint->load("index", "sa", &m_sa_samples);
+    checkpoint->load("index", "alphabet", &alphabet);
+    checkpoint->load("index", "psi", &m_psi);
+    m_alphabet.assign(alphabet.begin(), alphabet.end());
+    build_c_array();
+  } else {
+    std::string bwt_filename = checkpoint->filename("bwt", "bwt");
+    if (checkpoint->done("bwt")) {
+      checkpoint->load("bwt", "sa", &m_sa_samples);
+    } else {
+      bwt_filename = build_bwt(kernel_filename, ram_use, k, first, checkpoint, sample_density);
+      checkpoint->store("bwt", "sa", m_sa_samples);
+      checkpoint->commit("bwt", { "bwt", "sa" });
+      checkpoint->discard("sa");
+    }
 
-  // Construct suffix array with pSAscan
-  // TODO: pSAscan public API
-  const std::string sa_construct_command = std::string(PROJECT_ROOT) + std::string("/ext/pSAscan/src/psascan ") + kernel_filename;
-  std::cout << "We wil call:\n" << sa_construct_command << std::endl;
-  if (system(sa_construct_command.c_str())) {
-    std::cout << "Command failed. " << std::endl;
-    exit(-1);
+    load_bwt(bwt_filename, psi, true);
+    checkpoint->store("index", "bwt", m_tree);
+    checkpoint->store("index", "sa", m_sa_samples);
+    checkpoint->store("index", "alphabet", stored_alphabet());
+    checkpoint->store("index", "psi", m_psi);
+    checkpoint->commit("index", { "bwt", "sa", "alphabet", "psi" });
+    checkpoint->discard("bwt");
   }
 
-  // !!!
+  if (first != nullptr && first->empty() && checkpoint->done("boundaries")) {
+    checkpoint->load("boundaries", "first", first);
+  }
+}
+
+template<class wt_t>
+std::string index_t<wt_t>::build_bwt(const std::string &kernel_filename, const long ram_use,
+    const size_t k, sdsl::bit_vector *first, checkpoint_t *checkpoint,
+    const size_t sample_density) {
+  // A checkpointed BWT is written straight to the checkpoint
+  std::string bwt_filename = (checkpoint != nullptr) ?
+    checkpoint->filename("bwt", "bwt") : kernel_filename + ".bwt";
+
   FILE *in = fopen(kernel_filename.c_str(), "r");
+  if (in == nullptr) {
+    std::cerr << "[E::" << __func__ << "]: Unable to read \"" << kernel_filename << "\"!" << std::endl;
+    exit(1);
+  }
+
   const size_t n = filelength(in);
   fclose(in);
 
-  const size_t num_of_samples = n / SA_SAMPLE_DENSITY;
-  m_sa_samples = sdsl::int_vector<>(num_of_samples + 1, 0, 64);
+  sa_samples_builder_t samples(n, sample_density);
+
+  // The samples and the k-mer boundaries stay in memory during the passes
+  const long build_ram = ram_use -
+    static_cast<long>(sa_samples_builder_t::size_in_bytes(n, sample_density)) -
+    ((first != nullptr) ? static_cast<long>((n + 8) / 8) : 0);
+
+  if (n * INMEM_RAM_PER_SYMBOL <= static_cast<size_t>(build_ram)) {
+    // The text and the suffix array fit in memory
+    unsigned char *text = load_text(kernel_filename, n);
+    if (first != nullptr) {
+      *first = sdsl::bit_vector(n + 1, false);
+    }
+
+    if (checkpoint == nullptr) {
+      bwt_filename = sdsl::ram_file_name(bwt_filename);
+    }
+
+    if (n < (1UL << 31)) {
+      inmem_bwt<int>(text, n, bwt_filename, &samples, k, first);
+    } else {
+      inmem_bwt<uint40>(text, n, bwt_filename, &samples, k, first);
+    }
+    delete[] text;
+  } else if (2 * n + BWT_STREAM_RAM <= static_cast<size_t>(build_ram)) {
+    // The text fits in memory next to pSAscan
+    unsigned char *text = load_text(kernel_filename, n);
+    if (first != nullptr) {
+      *first = sdsl::bit_vector(n + 1, false);
+    }
+
+    stream_bwt(kernel_filename, text, n, build_ram - static_cast<long>(n) - BWT_STREAM_RAM,
+      bwt_filename, &samples, k, first);
+    delete[] text;
+  } else {
+    // Only the RAM budget is held in memory at a time. The suffix array is
+    // kept until the BWT is recorded, if checkpointing.
+    const std::string suffix_filename = (checkpoint != nullptr) ?
+      checkpoint->filename("sa", "sa5") : kernel_filename + ".sa5";
+    if (checkpoint == nullptr || !checkpoint->done("sa")) {
+      phase_t phase("psascan");
+      psascan_private::pSAscan(kernel_filename, suffix_filename, suffix_filename,
+        build_ram, max_threads(), false);
+      if (checkpoint != nullptr) {
+        checkpoint->commit("sa", { "sa5" });
+      }
+    }
+
+    phase_t phase("em_bwt");
+    em_bwt(kernel_filename, suffix_filename, n, build_ram, bwt_filename,
+      &samples, checkpoint != nullptr);
+  }
+  m_sa_samples = samples.finish();
+
+  // The boundaries computed with the BWT are recorded on their own, since
+  // graph construction replaces them
+  if (checkpoint != nullptr && first != nullptr && !first->empty()) {
+    checkpoint->store("boundaries", "first", *first);
+    checkpoint->commit("boundaries", { "first" });
+  }
+
+  return bwt_filename;
+}
+
+template<class wt_t>
+long index_t<wt_t>::min_ram_use(const size_t n, const size_t sample_density, const bool psi) {
+  // pSAscan and the external memory BWT run one after the other, followed
+  // by the wavelet tree construction
+  const long psascan = PSASCAN_RAM_PER_THREAD * max_threads() + PSASCAN_MIN_BLOCK_RAM;
+  const long bwt = std::max(psascan, em_bwt_min_ram_use(n));
+  const long tree = static_cast<long>(n * (WT_BITS_PER_SYMBOL + PSI_BITS(psi)) / 8);
+
+  return static_cast<long>(sa_samples_builder_t::size_in_bytes(n, sample_density)) +
+    std::max(bwt, tree);
+}
+
+template<class wt_t>
+long index_t<wt_t>::ram_use(const size_t n, const size_t sample_density, const bool psi) {
+  return static_cast<long>(sa_samples_builder_t::size_in_bytes(n, sample_density)) +
+    static_cast<long>(n * WT_BITS_PER_SYMBOL / 16) + static_cast<long>(n * PSI_BITS(psi) / 8);
+}
+
+template<class wt_t>
+std::vector<uint64_t> index_t<wt_t>::insertion_ranks(const std::string &kernel_filename,
+    const std::vector<sa_text_t> &texts) const {
+  phase_t phase("insertion_ranks");
+
+  FILE *in = fopen(kernel_filename.c_str(), "r");
+  if (in == nullptr) {
+    std::cerr << "[E::" << __func__ << "]: Unable to read \"" << kernel_filename << "\"!" << std::endl;
+    exit(1);
+  }
+
+  const size_t m = filelength(in);
+  fclose(in);
+
+  unsigned char *text = load_text(kernel_filename, m);
+
+  // Number of symbols smaller than each symbol, including the ones that do
+  // not occur in this index
+  std::vector<size_t> less(257, 0);
+  for (size_t symbol = 0; symbol < 256; symbol++) {
+    uint8_t c;
+    const bool occurs = code(static_cast<uint8_t>(symbol), &c);
+    less[symbol + 1] = less[symbol] + (occurs ? m_c_array[c + 1] - m_c_array[c] : 0);
+  }
+
+  // Backward search of every suffix of the texts, starting each text from
+  // the empty suffix which is smaller than all the rows
+  std::vector<uint64_t> ranks(m);
+  size_t rank = 0, t = texts.size();
+  for (size_t i = m; i > 0; i--) {
+    if (t > 0 && i == texts[t - 1].position) {
+      rank = 0;
+      t--;
+    }
+
+    uint8_t c;
+    const bool occurs = code(text[i - 1], &c);
+    if (occurs && c == m_wrap) {
+      rank = m_sa_samples.skip(rank, m_tree.rank(rank, c), m_c_array[c]);
+    } else {
+      rank = less[text[i - 1]] + (occurs ? m_tree.rank(rank, c) : 0);
+    }
+    ranks[i - 1] = rank;
+  }
+  delete[] text;
+
+  std::sort(ranks.begin(), ranks.end());
+  return ranks;
+}
+
+template<class wt_t>
+index_t<wt_t>::index_t(const index_t &a, const index_t &b, const std::vector<uint64_t> &ranks,
+    const std::string &bwt_filename) {
+  phase_t phase("merge_bwt");
+
+  const size_t n = a.size() + b.size();
+  if (a.sample_density() != b.sample_density()) {
+    std::cerr << "[E::" << __func__ << "]: Indexes with different sample densities " <<
+      "can not be merged!" << std::endl;
+    exit(1);
+  }
+
+  // LF wraps around at the last symbol of the texts, which must be one
+  if (a.m_alphabet[a.m_wrap] != b.m_alphabet[b.m_wrap]) {
+    std::cerr << "[E::" << __func__ << "]: Indexes of texts ending with different symbols " <<
+      "can not be merged!" << std::endl;
+    exit(1);
+  }
+
+  // The texts of b follow the texts of a, and so do their samples
+  sa_samples_builder_t samples(n, a.sample_density(),
+    a.m_sa_samples.texts().size() + b.m_sa_samples.texts().size());
+  {
+    psascan_private::async_stream_writer<unsigned char> out(bwt_filename);
+
+    size_t i = 0, j = 0, number;
+    for (size_t row = 0; row < n; row++) {
+      // The rows of b with the same rank go before the row of a
+      if (j < ranks.size() && (i == a.size() || ranks[j] == i)) {
+        out.write(b.symbol(j));
+        if (b.m_sa_samples.sample(j, &number)) {
+          samples.add_number(row, number + a.m_sa_samples.size());
+        }
+        j++;
+      } else {
+        out.write(a.symbol(i));
+        if (a.m_sa_samples.sample(i, &number)) {
+          samples.add_number(row, number);
+        }
+        i++;
+      }
+    }
+  }
+
+  // A row of a is preceded by the rows of b with at most its rank, and a
+  // row of b by the rows of a below its rank
+  std::vector<sa_text_t> texts = a.m_sa_samples.texts();
+  for (size_t t = 0; t < texts.size(); t++) {
+    texts[t].start_row += static_cast<uint64_t>(std::upper_bound(ranks.begin(), ranks.end(),
+      texts[t].start_row) - ranks.begin());
+    texts[t].end_row += static_cast<uint64_t>(std::upper_bound(ranks.begin(), ranks.end(),
+      texts[t].end_row) - ranks.begin());
+  }
+
+  for (const sa_text_t &text : b.m_sa_samples.texts()) {
+    sa_text_t shifted = text;
+    shifted.position += a.size();
+    shifted.base += a.m_sa_samples.size();
+    shifted.start_row += ranks[text.start_row];
+    shifted.end_row += ranks[text.end_row];
+    texts.push_back(shifted);
+  }
+
+  m_sa_samples = samples.finish(texts);
+  load_bwt(bwt_filename, a.has_psi());
+}
 
-  stream_bwt(kernel_filename, suffix_filename, bwt_filename, &m_sa_samples);
-  sdsl::construct(m_tree, bwt_filename, 1);
+template<class wt_t>
+bool index_t<wt_t>::sample_text(const size_t start_row, const size_t density) {
+  phase_t phase("sample_text");
 
+  // The suffix of the last symbol alone is the first row starting with it
+  const size_t n = size();
+  const uint8_t wrap = static_cast<uint8_t>(m_tree[start_row]);
+  sa_text_t text = { 0, 0, start_row, m_c_array[wrap] };
+  m_sa_samples = sa_samples_t(density, sdsl::bit_vector(), sdsl::int_vector<>(),
+    std::vector<sa_text_t>(1, text));
   build_c_array();
 
-  // Delete SA and BWT files
-  const std::string delete_command = "rm -f " + suffix_filename + " " + bwt_filename;
-  std::cout << "We wil call:\n" <<  delete_command << std::endl;
-  if (system(delete_command.c_str())) {
-    std::cout << "Command failed. " << std::endl;
-    exit(-1);
+  // Rows of the sampled positions, in the order of the positions
+  std::vector<std::pair<uint64_t, uint64_t> > rows;
+  size_t row = start_row;
+  for (size_t step = 0; step < n; step++) {
+    // The walk must cover every row before it returns
+    if (step > 0 && row == start_row) {
+      return false;
+    }
+
+    const size_t suffix = (step == 0) ? 0 : n - step;
+    if ((suffix % density) == 0) {
+      rows.push_back(std::make_pair(row, suffix));
+    }
+    row = lf(row);
+  }
+
+  if (row != start_row) {
+    return false;
+  }
+  std::sort(rows.begin(), rows.end());
+
+  sa_samples_builder_t samples(n, density);
+  for (size_t i = 0; i < rows.size(); i++) {
+    samples.add(rows[i].first, rows[i].second);
+  }
+  m_sa_samples = samples.finish(std::vector<sa_text_t>(1, text));
+  return true;
+}
+
+// Indexes in separate files are resampled from the row of the whole text.
+// LF and psi only go astray at the separators, which are the smallest
+// symbol, so each old sample is followed back to the start of its sequence
+// and forward to its end. The start of a sequence goes to the end of the
+// one before it, which tells on which side of the row of the whole text
+// the start is. The separators left between the sides are tried in turn,
+// and checked against the old samples.
+template<class wt_t>
+void index_t<wt_t>::resample(const sdsl::int_vector<> &row_samples, const std::string &base) {
+  phase_t phase("resample");
+
+  const size_t n = size();
+  std::vector<std::pair<uint64_t, uint64_t> > starts;
+  std::unordered_map<uint64_t, uint64_t> ends;
+  for (size_t r = 0; r < row_samples.size() && r * SA_SAMPLE_DENSITY < n; r++) {
+    size_t row = r * SA_SAMPLE_DENSITY, position = row_samples[r];
+    while (m_tree[row] != 0) {
+      const uint8_t c = static_cast<uint8_t>(m_tree[row]);
+      row = m_c_array[c] + m_tree.rank(row, c);
+      position--;
+    }
+    starts.push_back(std::make_pair(position, row));
+
+    row = r * SA_SAMPLE_DENSITY;
+    position = row_samples[r];
+    uint8_t c;
+    for (size_t next = raw_psi(row, &c); c != 0; next = raw_psi(row, &c)) {
+      row = next;
+      position++;
+    }
+    ends[position] = row;
+  }
+
+  // The rows after the first one starting with a separator are in the order
+  // of the sequences after them, like the starts other than the whole text
+  size_t lo = 0, hi = n;
+  for (size_t s = 0; s < starts.size(); s++) {
+    const size_t position = starts[s].first, row = starts[s].second;
+    if (position == 0) {
+      lo = row;
+      hi = row + 1;
+      break;
+    }
+
+    const auto end = ends.find(position - 1);
+    if (end == ends.end()) {
+      continue;
+    }
+
+    if (m_tree.rank(row, 0) == end->second - m_c_array[0] - 1) {
+      lo = std::max(lo, row + 1);
+    } else {
+      hi = std::min(hi, row);
+    }
+  }
+
+  for (size_t k = m_tree.rank(lo, 0); k < m_tree.rank(hi, 0); k++) {
+    bool valid = sample_text(m_tree.select(k + 1, 0), SA_SAMPLE_DENSITY);
+    for (size_t r = 0; r < row_samples.size() && r * SA_SAMPLE_DENSITY < n && valid; r++) {
+      valid = (sa(r * SA_SAMPLE_DENSITY) == row_samples[r]);
+    }
+
+    if (valid) {
+      return;
+    }
   }
+
+  std::cerr << "[E::" << __func__ << "]: Unable to resample the suffix array of \"" <<
+    base << "\"!" << std::endl;
+  exit(1);
 }
+
+template<class wt_t>
+void index_t<wt_t>::locate(const std::vector<interval_t> &intervals,
+    std::vector<uint64_t> *positions, const size_t threads) const {
+  std::vector<size_t> offsets(intervals.size() + 1, 0);
+  for (size_t t = 0; t < intervals.size(); t++) {
+    const interval_t &interval = intervals[t];
+    offsets[t + 1] = offsets[t] +
+      ((interval.right >= interval.left) ? interval.right - interval.left + 1 : 0);
+  }
+
+  const size_t rows = offsets.back();
+  positions->resize(rows);
+
+  const size_t threads_count = std::max(static_cast<size_t>(1),
+    std::min(threads, rows / LOCATE_MIN_THREAD_ROWS));
+  if (threads_count == 1) {
+    locate_range(intervals, offsets, 0, rows, positions->data());
+    return;
+  }
+
+  const size_t range_size = (rows + threads_count - 1) / threads_count;
+  std::vector<std::thread> pool;
+  for (size_t beg = 0; beg < rows; beg += range_size) {
+    pool.push_back(std::thread(&index_t::locate_range, this, std::cref(intervals),
+      std::cref(offsets), beg, std::min(rows, beg + range_size), positions->data()));
+  }
+
+  for (size_t t = 0; t < pool.size(); t++) {
+    pool[t].join();
+  }
+}
+
+// Each lane of the batch walks one row until it is sampled, and then takes
+// the next row. A step of a lane prefetches the next row it reads, which
+// is in cache by the time the other lanes have taken their steps.
+template<class wt_t>
+void index_t<wt_t>::locate_range(const std::vector<interval_t> &intervals,
+    const std::vector<size_t> &offsets, const size_t beg, const size_t end,
+    uint64_t *positions) const {
+  size_t rows[LOCATE_BATCH], slots[LOCATE_BATCH], steps[LOCATE_BATCH];
+
+  // The interval of the next slot to hand out
+  size_t t = static_cast<size_t>(std::upper_bound(offsets.begin(), offsets.end(), beg) -
+    offsets.begin()) - 1;
+  size_t next = beg;
+
+  size_t lanes = 0;
+  while (lanes < LOCATE_BATCH && next < end) {
+    while (next == offsets[t + 1])
+      t++;
+    rows[lanes] = intervals[t].left + (next - offsets[t]);
+    slots[lanes] = next++;
+    steps[lanes] = 0;
+    prefetch_position(m_tree, rows[lanes]);
+    lanes++;
+  }
+
+  while (lanes > 0) {
+    for (size_t l = 0; l < lanes; l++) {
+      size_t position;
+      if (!m_sa_samples.lookup(rows[l], &position)) {
+        rows[l] = lf(rows[l]);
+        steps[l]++;
+        prefetch_position(m_tree, rows[l]);
+        continue;
+      }
+
+      positions[slots[l]] = position + steps[l];
+      if (next < end) {
+        while (next == offsets[t + 1])
+          t++;
+        rows[l] = intervals[t].left + (next - offsets[t]);
+        slots[l] = next++;
+        steps[l] = 0;
+        prefetch_position(m_tree, rows[l]);
+      } else {
+        // The last lane takes the place of the finished one
+        lanes--;
+        rows[l] = rows[lanes];
+        slots[l] = slots[lanes];
+        steps[l] = steps[lanes];
+        l--;
+      }
+    }
+  }
+}
+
+// All constructions leave the BWT as plain bytes, which are replaced by
+// their ranks in the alphabet in a file next to it
+template<class wt_t>
+void index_t<wt_t>::load_bwt(const std::string &bwt_filename, const bool psi, const bool keep) {
+  phase_t phase("wavelet_tree");
+
+  const std::string dense_filename = bwt_filename + ".dense";
+  size_t n;
+  {
+    sdsl::int_vector_buffer<8> bwt(bwt_filename, std::ios::in, 1 << 20, 8, true);
+    n = bwt.size();
+
+    std::vector<bool> occurs(256, false);
+    for (size_t i = 0; i < n; i++) {
+      occurs[bwt[i]] = true;
+    }
+
+    m_alphabet.clear();
+    for (size_t c = 0; c < 256; c++) {
+      if (occurs[c]) m_alphabet.push_back(static_cast<uint8_t>(c));
+    }
+
+    std::vector<uint8_t> codes(256, 0);
+    for (size_t c = 0; c < m_alphabet.size(); c++) {
+      codes[m_alphabet[c]] = static_cast<uint8_t>(c);
+    }
+
+    sdsl::int_vector_buffer<8> dense(dense_filename, std::ios::out, 1 << 20, 8, true);
+    for (size_t i = 0; i < n; i++) {
+      dense.push_back(codes[bwt[i]]);
+    }
+    dense.close();
+    bwt.close(!keep);
+  }
+
+  sdsl::int_vector_buffer<8> dense(dense_filename, std::ios::in, 1 << 20, 8, true);
+  m_tree = wt_t(dense, n);
+  if (psi) {
+    phase_t psi_phase("psi");
+    m_psi = psi_t(dense, n, m_alphabet.size());
+  } else {
+    m_psi = psi_t();
+  }
+  dense.close(true);
+
+  build_c_array();
+}
+
+template<class wt_t>
+wt_t index_t<wt_t>::dense_tree(const huff_rrr_wt_t &tree, std::vector<uint8_t> *alphabet) {
+  alphabet->clear();
+  for (size_t c = 0; c < 256; c++) {
+    if (tree.rank(tree.size(), static_cast<uint8_t>(c)) > 0) {
+      alphabet->push_back(static_cast<uint8_t>(c));
+    }
+  }
+
+  std::vector<uint8_t> codes(256, 0);
+  for (size_t c = 0; c < alphabet->size(); c++) {
+    codes[(*alphabet)[c]] = static_cast<uint8_t>(c);
+  }
+
+  // Every backend is constructed from a buffer, like in load_bwt
+  const std::string dense_filename = sdsl::ram_file_name("dense_tree_" +
+    sdsl::util::to_string(sdsl::util::id()));
+  {
+    sdsl::int_vector_buffer<8> dense(dense_filename, std::ios::out, 1 << 20, 8, true);
+    for (size_t i = 0; i < tree.size(); i++) {
+      dense.push_back(codes[tree[i]]);
+    }
+  }
+
+  sdsl::int_vector_buffer<8> dense(dense_filename, std::ios::in, 1 << 20, 8, true);
+  wt_t result(dense, tree.size());
+  dense.close(true);
+  return result;
+}
+
+INSTANTIATE_BACKENDS(index_t)
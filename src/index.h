@@ -3,26 +3,64 @@
 #ifndef WANDA_INDEX_H_
 #define WANDA_INDEX_H_
 
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include <sdsl/bit_vectors.hpp>
 #include <sdsl/wavelet_trees.hpp>
 
+#include "backend.h"
+#include "checkpoint.h"
+#include "container.h"
 #include "interval.h"
+#include "psi.h"
+#include "sa_samples.h"
 
-#define SA_SAMPLE_DENSITY 32
+// Default RAM budget for construction, matching pSAscan's command line default
+#define DEFAULT_RAM_USE (3072L << 20)
 
+static inline long max_threads() {
+  return std::max(1L, static_cast<long>(std::thread::hardware_concurrency()));
+}
+
+// FM-index over a BWT represented by wt_t, one of the backends
+template<class wt_t>
 class index_t {
 public:
-  index_t(const std::string &kernel_filename);
-
-  index_t(const sdsl::wt_huff<sdsl::rrr_vector<127> > &tree, const sdsl::int_vector<> &sa_samples) :
-      m_tree(tree), m_sa_samples(sa_samples) {
+  // Constructs the index of a text file. If first is given, it is set to
+  // mark the rows starting a new k-mer, when that falls out of the
+  // construction; otherwise it is left empty. With a checkpoint, the
+  // outputs of the passes are recorded and the completed ones are skipped.
+  // Every sample_density-th position of the text is sampled. If psi is set,
+  // Ψ is stored for forward steps without select on the tree.
+  index_t(const std::string &kernel_filename, const long ram_use = DEFAULT_RAM_USE,
+    const size_t k = 0, sdsl::bit_vector *first = nullptr, checkpoint_t *checkpoint = nullptr,
+    const size_t sample_density = SA_SAMPLE_DENSITY, const bool psi = false);
+
+  // Merges the indexes of two texts into the index of their concatenation.
+  // The ranks are the insertion ranks of the suffixes of the second text
+  // among the rows of the first, see insertion_ranks. The samples of both
+  // are kept, so they must have the same density. Ψ is stored if a stores it.
+  index_t(const index_t &a, const index_t &b, const std::vector<uint64_t> &ranks,
+    const std::string &bwt_filename);
+
+  // Takes the structures by value, so that callers can move them in. The
+  // tree is over the dense codes of the symbols in the alphabet.
+  index_t(wt_t tree, sa_samples_t sa_samples, std::vector<uint8_t> alphabet, psi_t psi) :
+      m_tree(std::move(tree)), m_sa_samples(std::move(sa_samples)), m_psi(std::move(psi)),
+      m_alphabet(std::move(alphabet)) {
     build_c_array();
   }
 
+  // Indexes in separate files have a Huffman shaped tree over the symbols
+  // themselves, which is rebuilt with the backend, and the suffix array
+  // sampled at every SA_SAMPLE_DENSITY-th row, which is resampled by text
+  // position
   static index_t load(const std::string &base) {
-    sdsl::wt_huff<sdsl::rrr_vector<127> > tree;
+    huff_rrr_wt_t tree;
     sdsl::int_vector<> sa_samples;
 
     sdsl::load_from_file(tree, base + ".bwt");
@@ -40,118 +78,403 @@ public:
       std::cerr << std::endl;
     #endif
 
-    return index_t(tree, sa_samples);
+    std::vector<uint8_t> alphabet;
+    wt_t dense = dense_tree(tree, &alphabet);
+    index_t index(std::move(dense), sa_samples_t(), std::move(alphabet), psi_t());
+    index.resample(sa_samples, base);
+    return index;
   }
 
-  void store_to_file(const std::string &base) const {
-    sdsl::store_to_file(m_tree, base + ".bwt");
-    sdsl::store_to_file(m_sa_samples, base + ".sa");
+  static index_t load(const container_t &container) {
+    wt_t tree;
+    sa_samples_t sa_samples;
+    sdsl::int_vector<8> alphabet;
+    psi_t psi;
+
+    container.load(SECTION_BWT, &tree);
+    container.load(SECTION_SA, &sa_samples);
+    container.load(SECTION_ALPHABET, &alphabet);
+    if (container.flags() & CONTAINER_PSI) {
+      container.load(SECTION_PSI, &psi);
+    }
+
+    return index_t(std::move(tree), std::move(sa_samples),
+      std::vector<uint8_t>(alphabet.begin(), alphabet.end()), std::move(psi));
+  }
+
+  void store(container_writer_t *container) const {
+    container->store(SECTION_BWT, m_tree);
+    container->store(SECTION_SA, m_sa_samples);
+    container->store(SECTION_ALPHABET, stored_alphabet());
+    if (has_psi()) {
+      container->store(SECTION_PSI, m_psi);
+    }
   }
 
   inline size_t size() const {
     return m_tree.size();
   }
 
-  size_t sa(const size_t position) const {
-    size_t i = position, offset = 0;
-    while ((i % SA_SAMPLE_DENSITY) != 0) {
+  inline bool has_psi() const {
+    return !m_psi.empty();
+  }
+
+  // The positions of the suffixes of the rows of many intervals, one after
+  // the other in the order of the intervals. The LF walks of a batch of
+  // rows are advanced in turns, so that their memory accesses overlap, and
+  // the rows are split between threads.
+  void locate(const std::vector<interval_t> &intervals, std::vector<uint64_t> *positions,
+    const size_t threads = static_cast<size_t>(max_threads())) const;
+
+  // The position of the suffix of a row, in less than the sample density
+  // steps of LF
+  size_t sa(const size_t row) const {
+    size_t i = row, steps = 0, position;
+    while (!m_sa_samples.lookup(i, &position)) {
       i = lf(i);
-      offset++;
+      steps++;
     }
 
-    const size_t result = m_sa_samples[i / SA_SAMPLE_DENSITY] + offset;
-    return (result < m_tree.size()) ? result : result - m_tree.size();
+    return position + steps;
   }
 
   std::vector<uint8_t> interval_symbols(const size_t left, const size_t right) const {
     if (left == right) {
-      std::vector<uint8_t> alphabet = { m_tree[left] };
+      std::vector<uint8_t> alphabet = { symbol(left) };
       return alphabet;
     }
 
-    sdsl::int_vector_size_type extensions;
-    std::vector<uint8_t> alphabet(m_tree.sigma);
-    std::vector<uint64_t> ranks_i(m_tree.sigma);
-    std::vector<uint64_t> ranks_j(m_tree.sigma);
+    size_t extensions;
+    const symbol_ranks_t &ranks = symbol_ranks(left, right + 1, &extensions);
 
-    m_tree.interval_symbols(left, right + 1, extensions, alphabet, ranks_i, ranks_j);
-
-    while (alphabet.size() > extensions)
-      alphabet.pop_back();
+    std::vector<uint8_t> alphabet(extensions);
+    for (size_t i = 0; i < extensions; i++) {
+      alphabet[i] = m_alphabet[ranks.codes[i]];
+    }
 
     return alphabet;
   }
 
-  interval_t extend(const interval_t &interval, const uint8_t c) const {
-    const size_t c1 = m_c_array[c];
-    const size_t left = interval.left > 0 ? c1 + m_tree.rank(interval.left - 1, c) + 1 : c1 + 1;
-    const size_t right = c1 + m_tree.rank(interval.right, c);
-    return interval_t(left, right);
+  // Extends an interval to the left with every symbol occurring in its BWT
+  // range, returning the number of extensions
+  size_t extensions(const interval_t &interval, std::vector<uint8_t> *symbols,
+      std::vector<interval_t> *intervals) const {
+    size_t count;
+    const symbol_ranks_t &ranks = symbol_ranks(interval.left, interval.right + 1, &count);
+    symbols->resize(count);
+
+    intervals->clear();
+    for (size_t i = 0; i < count; i++) {
+      const interval_t extended = extension(interval, ranks.codes[i], ranks.ranks_i[i],
+        ranks.ranks_j[i]);
+      if (!extended.empty()) {
+        (*symbols)[intervals->size()] = m_alphabet[ranks.codes[i]];
+        intervals->push_back(extended);
+      }
+    }
+
+    symbols->resize(intervals->size());
+    return intervals->size();
   }
 
-  inline size_t lf(const size_t i) const {
-    const uint8_t c = m_tree[i];
+  // Extends an interval to the left with every symbol in one pass over the
+  // BWT, into sigma() intervals indexed by code. The intervals of the
+  // symbols not occurring in the BWT range are empty. Returns the number of
+  // nonempty intervals.
+  size_t extend_all(const interval_t &interval, interval_t *intervals) const {
+    size_t count;
+    const symbol_ranks_t &ranks = symbol_ranks(interval.left, interval.right + 1, &count);
+
+    std::fill(intervals, intervals + m_alphabet.size(), interval_t(1, 0));
+    size_t extended = 0;
+    for (size_t i = 0; i < count; i++) {
+      intervals[ranks.codes[i]] = extension(interval, ranks.codes[i], ranks.ranks_i[i],
+        ranks.ranks_j[i]);
+      extended += !intervals[ranks.codes[i]].empty();
+    }
 
-    if (m_c_array[c] == 0) {
-      return 0;
+    return extended;
+  }
+
+  interval_t extend(const interval_t &interval, const uint8_t symbol) const {
+    uint8_t c;
+    if (!code(symbol, &c)) {
+      return interval_t(1, 0);
     }
 
-    return m_c_array[c] + m_tree.rank(i, c);
+    return extension(interval, c, m_tree.rank(interval.left, c),
+      m_tree.rank(interval.right + 1, c));
   }
 
-  size_t inverse_lf(const size_t i, uint8_t *_c = nullptr) const {
-    uint8_t c = '\0';
-    for (size_t j = 1; j < m_c_array.size(); j++) {
-      if (m_c_array[j] > 0 && m_c_array[j] <= i)
-        c = static_cast<uint8_t>(j);
+  // The symbol of a code
+  inline uint8_t decode(const size_t c) const {
+    return m_alphabet[c];
+  }
+
+  // Number of distinct symbols, which is the number of codes
+  inline size_t sigma() const {
+    return m_alphabet.size();
+  }
+
+  // Smallest RAM budget the index of a text of length n can be constructed
+  // in, and an estimate of the memory of the finished index
+  static long min_ram_use(const size_t n, const size_t sample_density = SA_SAMPLE_DENSITY,
+    const bool psi = false);
+  static long ram_use(const size_t n, const size_t sample_density = SA_SAMPLE_DENSITY,
+    const bool psi = false);
+
+  // Ranks of the suffixes of the texts of another index, if they were
+  // appended to the texts of the index, among the rows of the index in
+  // sorted order. Needs only the appended texts in memory.
+  std::vector<uint64_t> insertion_ranks(const std::string &kernel_filename,
+    const std::vector<sa_text_t> &texts) const;
+
+  inline const std::vector<sa_text_t> &texts() const {
+    return m_sa_samples.texts();
+  }
+
+  inline uint8_t symbol(const size_t i) const {
+    return m_alphabet[m_tree[i]];
+  }
+
+  // The row of the next suffix in text order, and the first symbol of the
+  // row. This is the inverse of lf, so the end of a text goes to the start of
+  // the text after it.
+  inline size_t psi(const size_t i, uint8_t *symbol) const {
+    uint8_t c;
+    const size_t next = forward(i, &c);
+    *symbol = m_alphabet[c];
+
+    return next;
+  }
+
+  // Up to length first symbols of the suffix of a row, returning how many
+  // there are. Like the suffixes, they end at the end of their text.
+  size_t extract(size_t i, const size_t length, uint8_t *symbols) const {
+    for (size_t j = 0; j < length; j++) {
+      uint8_t c;
+      const size_t next = forward(i, &c);
+      symbols[j] = m_alphabet[c];
+      if (c == m_wrap && m_sa_samples.end(i)) {
+        return j + 1;
+      }
+      i = next;
     }
-    if (_c != nullptr) *_c = c;
 
-    if (m_c_array[c] == 0)
-      return 0;
+    return length;
+  }
 
-    return m_tree.select(i - m_c_array[c] + 1, c);
+  // The row of the previous suffix in text order, wrapping around at the
+  // start of each text
+  inline size_t lf(const size_t i) const {
+    const uint8_t c = static_cast<uint8_t>(m_tree[i]);
+    const size_t rank = m_tree.rank(i, c);
+
+    if (c != m_wrap) {
+      return m_c_array[c] + rank;
+    }
+
+    return m_sa_samples.wrap(i, rank, m_c_array[c]);
   }
 
-  interval_t inverse_lf(const interval_t &interval, uint8_t *_c = nullptr) const {
+  inline size_t sample_density() const {
+    return m_sa_samples.density();
+  }
+
+  // Rows starting with the smallest symbol report the symbol as '\0'
+  size_t inverse_lf(const size_t i, uint8_t *_c = nullptr) const {
     uint8_t c;
-    const size_t start = inverse_lf(interval.left, &c);
+    const size_t next = forward(i, &c);
+    if (_c != nullptr) *_c = (c == 0) ? '\0' : m_alphabet[c];
+
+    return (c == 0) ? 0 : next;
+  }
 
-    if (m_c_array[c] == 0)
+  interval_t inverse_lf(const interval_t &interval, uint8_t *_c = nullptr) const {
+    uint8_t symbol;
+    const size_t start = inverse_lf(interval.left, &symbol);
+
+    uint8_t c;
+    if (!code(symbol, &c) || m_c_array[c] == 0)
       return interval_t(0, 0);
 
     #ifdef DEBUG
       std::cout << "[D::" << __func__ << "]: " <<
         "(" << interval.left << ", " << interval.right << "), " <<
-        static_cast<char>(c) << ", " << m_c_array[c] << std::endl;
+        static_cast<char>(symbol) << ", " << m_c_array[c] << std::endl;
     #endif
 
-    const size_t end = m_tree.select(interval.right - m_c_array[c] + 1, c);
+    // The rows of the interval start with the same symbol
+    const size_t end = forward(interval.right, &c);
 
-    if (_c != nullptr) *_c = c;
+    if (_c != nullptr) *_c = symbol;
     return interval_t(start, end);
   }
 
 private:
+  // The codes occurring in a BWT range with their ranks at both ends
+  struct symbol_ranks_t {
+    std::vector<typename wt_t::value_type> codes;
+    std::vector<uint64_t> ranks_i;
+    std::vector<uint64_t> ranks_j;
+  };
+
+  // The sdsl trees take the results of interval_symbols in vectors, so each
+  // thread reuses its own, and queries neither allocate nor share them
+  const symbol_ranks_t &symbol_ranks(const size_t i, const size_t j, size_t *count) const {
+    static thread_local symbol_ranks_t ranks;
+    if (ranks.codes.size() < m_tree.sigma) {
+      ranks.codes.resize(m_tree.sigma);
+      ranks.ranks_i.resize(m_tree.sigma);
+      ranks.ranks_j.resize(m_tree.sigma);
+    }
+
+    sdsl::int_vector_size_type k;
+    m_tree.interval_symbols(i, j, k, ranks.codes, ranks.ranks_i, ranks.ranks_j);
+    *count = static_cast<size_t>(k);
+    return ranks;
+  }
+
+  // Locates the rows of the slots [beg, end) of the output of locate
+  void locate_range(const std::vector<interval_t> &intervals, const std::vector<size_t> &offsets,
+    const size_t beg, const size_t end, uint64_t *positions) const;
+
+  // Constructs the BWT and the SA samples, returning the file of the BWT
+  std::string build_bwt(const std::string &kernel_filename, const long ram_use,
+    const size_t k, sdsl::bit_vector *first, checkpoint_t *checkpoint,
+    const size_t sample_density);
+
+  // Builds the tree over the dense codes of a BWT of plain bytes, and Ψ if
+  // psi is set
+  void load_bwt(const std::string &bwt_filename, const bool psi, const bool keep = false);
+
+  // Samples a single text by walking it backwards with LF from the row of
+  // the whole text. Fails if LF is not one cycle over the rows.
+  bool sample_text(const size_t start_row, const size_t density);
+
+  // Replaces the samples of every SA_SAMPLE_DENSITY-th row of an index in
+  // separate files
+  void resample(const sdsl::int_vector<> &row_samples, const std::string &base);
+
+  // Ψ from the stored sequence, or by select on the tree for the indexes
+  // without it, and the code of the first symbol of the row
+  inline size_t raw_psi(const size_t i, uint8_t *c) const {
+    if (!m_psi.empty()) {
+      return m_psi(i, c);
+    }
+
+    *c = static_cast<uint8_t>(std::upper_bound(m_c_array.begin(), m_c_array.end(), i) -
+      m_c_array.begin() - 1);
+    return m_tree.select(i - m_c_array[*c] + 1, *c);
+  }
+
+  // Ψ corrected like lf, and the code of the first symbol of the row. The
+  // rows starting with the last symbol of the texts are the occurrences of
+  // the symbol that are not the starts of the texts, except for the ends.
+  inline size_t forward(const size_t i, uint8_t *c) const {
+    const size_t next = raw_psi(i, c);
+    if (*c != m_wrap || m_start_gaps.empty()) {
+      return next;
+    }
+
+    size_t rank;
+    if (m_sa_samples.unwrap(i, m_c_array[m_wrap], &rank)) {
+      return rank;
+    }
+
+    rank += static_cast<size_t>(std::upper_bound(m_start_gaps.begin(), m_start_gaps.end(), rank) -
+      m_start_gaps.begin());
+    return raw_psi(m_c_array[m_wrap] + rank, c);
+  }
+
+  // The rows preceded by a code among the rows of an interval, given the
+  // ranks of the code at both ends. The starts of the texts are preceded by
+  // the last symbol of the texts only by wrapping around, so they are left
+  // out, except when extending every row, which gives every row starting
+  // with the symbol.
+  inline interval_t extension(const interval_t &interval, const uint8_t c, const size_t rank_i,
+      const size_t rank_j) const {
+    const size_t c1 = m_c_array[c];
+    if (c != m_wrap || m_start_gaps.empty() ||
+        (interval.left == 0 && interval.right + 1 == size())) {
+      return (rank_j > rank_i) ? interval_t(c1 + rank_i, c1 + rank_j - 1) : interval_t(1, 0);
+    }
+
+    const size_t left = rank_i - m_sa_samples.starts(interval.left);
+    const size_t right = rank_j - m_sa_samples.starts(interval.right + 1);
+    return (right > left) ?
+      interval_t(m_sa_samples.place(left, c1), m_sa_samples.place(right - 1, c1)) :
+      interval_t(1, 0);
+  }
+
+  // The dense code of a symbol, if it occurs in the text
+  inline bool code(const uint8_t symbol, uint8_t *c) const {
+    *c = m_codes[symbol];
+    return m_alphabet[*c] == symbol;
+  }
+
+  sdsl::int_vector<8> stored_alphabet() const {
+    sdsl::int_vector<8> alphabet(m_alphabet.size());
+    for (size_t i = 0; i < m_alphabet.size(); i++) {
+      alphabet[i] = m_alphabet[i];
+    }
+    return alphabet;
+  }
+
+  // Rebuilds a tree over symbols as a tree over their dense codes
+  static wt_t dense_tree(const huff_rrr_wt_t &tree, std::vector<uint8_t> *alphabet);
+
   void build_c_array() {
-    std::vector<uint8_t> alphabet = this->interval_symbols(0, m_tree.size()-1);
-    std::sort(alphabet.begin(), alphabet.end());
-    assert(alphabet.size() != 0);
+    assert(m_alphabet.size() != 0);
 
-    std::vector<size_t> counts(256);
-    counts[alphabet[0]] = 0;
-    for (size_t i = 1; i < alphabet.size(); i++) {
-      const size_t count_prev = m_tree.rank(m_tree.size(), alphabet[i-1]) - m_tree.rank(0, alphabet[i-1]);
-      counts[alphabet[i]] = counts[alphabet[i-1]] + count_prev;
+    m_codes = std::vector<uint8_t>(256, 0);
+    for (size_t c = 0; c < m_alphabet.size(); c++) {
+      m_codes[m_alphabet[c]] = static_cast<uint8_t>(c);
     }
 
-    m_c_array = counts;
+    m_c_array = std::vector<size_t>(m_alphabet.size() + 1, 0);
+    for (size_t c = 0; c < m_alphabet.size(); c++) {
+      m_c_array[c + 1] = m_c_array[c] + m_tree.rank(m_tree.size(), static_cast<uint8_t>(c));
+    }
+
+    const std::vector<sa_text_t> &texts = m_sa_samples.texts();
+    m_wrap = texts.empty() ? 0 : static_cast<uint8_t>(m_tree[texts[0].start_row]);
+
+    m_start_gaps.clear();
+    for (size_t t = 0; t < texts.size(); t++) {
+      m_start_gaps.push_back(m_tree.rank(texts[t].start_row, m_wrap));
+    }
+    std::sort(m_start_gaps.begin(), m_start_gaps.end());
+    for (size_t j = 0; j < m_start_gaps.size(); j++) {
+      m_start_gaps[j] -= j;
+    }
   }
 
 private:
-  sdsl::wt_huff<sdsl::rrr_vector<127> > m_tree;
-  sdsl::int_vector<> m_sa_samples;
+  // BWT over the dense codes of the symbols, which are their ranks in the
+  // alphabet, so the tree, C array and queries only span the symbols that
+  // occur. DNA needs at most six.
+  wt_t m_tree;
+  sa_samples_t m_sa_samples;
+
+  // Forward steps without select on the tree, if they were asked for
+  psi_t m_psi;
+
+  // Number of symbols with a smaller code, indexed by code, followed by the
+  // length of the text
   std::vector<size_t> m_c_array;
+
+  // Symbols occurring in the BWT in sorted order, indexed by code, and the
+  // code of each symbol
+  std::vector<uint8_t> m_alphabet;
+  std::vector<uint8_t> m_codes;
+
+  // Code of the last symbol of the texts, where LF wraps around, and the
+  // ranks of the starts of the texts among its occurrences in row order,
+  // less the number of starts before them. A rank leaving out the starts
+  // skips every start whose gap is at most the rank.
+  uint8_t m_wrap;
+  std::vector<uint64_t> m_start_gaps;
 };
 
 #endif
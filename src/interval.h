@@ -7,6 +7,8 @@ class interval_t {
  public:
   size_t left, right;
 
+  // Empty, like a search that matches nothing
+  interval_t() : left(1), right(0) {}
   interval_t(const size_t _left, const size_t _right) : left(_left), right(_right) {}
   interval_t(const interval_t &interval) : left(interval.left), right(interval.right) {}
   interval_t(interval_t&& interval) noexcept : left(interval.left), right(interval.right) {}
@@ -25,6 +27,11 @@ class interval_t {
     return *this;
   }
 
+  // Searches return (1, 0) when nothing matches
+  inline bool empty() const {
+    return left > right;
+  }
+
   inline bool operator==(const interval_t &interval) const {
     return (left == interval.left && right == interval.right);
   }
@@ -0,0 +1,22 @@
+// Copyright 2017 Riku Walve
+
+#ifndef WANDA_LCP_H_
+#define WANDA_LCP_H_
+
+#include <algorithm>
+#include <cstddef>
+
+// Length of the longest common prefix of the suffixes a and b of a text of
+// length n, but at most max. The suffixes end at the end of the text.
+static inline size_t lcp(const unsigned char *text, const size_t n,
+    const size_t a, const size_t b, const size_t max) {
+  const size_t length = std::min(max, n - std::max(a, b));
+
+  size_t l = 0;
+  while (l < length && text[a + l] == text[b + l])
+    l++;
+
+  return l;
+}
+
+#endif
@@ -0,0 +1,244 @@
+// Copyright 2017 Riku Walve
+
+#ifndef WANDA_MAPPED_H_
+#define WANDA_MAPPED_H_
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <streambuf>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sdsl/int_vector.hpp>
+
+// A file mapped into memory read-only. It is unmapped when the container
+// and every structure pointing into it are gone.
+class mapping_t {
+public:
+  mapping_t(const char *data, const size_t length) : m_data(data), m_length(length) {}
+
+  ~mapping_t() {
+    munmap(const_cast<char*>(m_data), m_length);
+  }
+
+  mapping_t(const mapping_t&) = delete;
+  mapping_t& operator=(const mapping_t&) = delete;
+
+  inline const char *data() const {
+    return m_data;
+  }
+
+private:
+  const char *m_data;
+  const size_t m_length;
+};
+
+// Input stream over a region of a mapping. The structures loaded from it
+// can take their arrays from the mapping instead of copying them, see
+// mapped_array_t.
+class memory_buffer_t : public std::streambuf {
+public:
+  memory_buffer_t(std::shared_ptr<const mapping_t> mapping, const char *data,
+      const size_t length) : m_mapping(std::move(mapping)) {
+    char *begin = const_cast<char*>(data);
+    setg(begin, begin, begin + length);
+  }
+
+  // Takes the next bytes without copying them, or returns nullptr if there
+  // are not that many left
+  const char *take(const size_t bytes) {
+    if (static_cast<size_t>(egptr() - gptr()) < bytes) {
+      return nullptr;
+    }
+
+    const char *data = gptr();
+    setg(eback(), gptr() + bytes, egptr());
+    return data;
+  }
+
+  inline const std::shared_ptr<const mapping_t> &mapping() const {
+    return m_mapping;
+  }
+
+private:
+  std::shared_ptr<const mapping_t> m_mapping;
+};
+
+// An array of plain values, which either owns them or points into a
+// mapping it keeps alive. Arrays are stored aligned to a given number of
+// bytes, so that one loaded from a mapping is used where it lies. Loading
+// from any other stream, or from a mapping where the array is not aligned
+// to its type, copies it. The pointer is rebound whenever the array is
+// copied or moved, so the structures holding one keep the default copies
+// and moves.
+template<typename T, class allocator_t = std::allocator<T> >
+class mapped_array_t {
+public:
+  mapped_array_t() : m_data(nullptr), m_size(0) {
+    bind();
+  }
+
+  explicit mapped_array_t(std::vector<T, allocator_t> values) :
+      m_values(std::move(values)), m_data(nullptr), m_size(0) {
+    bind();
+  }
+
+  mapped_array_t(const mapped_array_t &array) :
+      m_values(array.m_values), m_mapping(array.m_mapping), m_data(array.m_data),
+      m_size(array.m_size) {
+    bind();
+  }
+
+  mapped_array_t(mapped_array_t &&array) :
+      m_values(std::move(array.m_values)), m_mapping(std::move(array.m_mapping)),
+      m_data(array.m_data), m_size(array.m_size) {
+    bind();
+  }
+
+  mapped_array_t& operator=(const mapped_array_t &array) {
+    m_values = array.m_values;
+    m_mapping = array.m_mapping;
+    m_data = array.m_data;
+    m_size = array.m_size;
+    bind();
+    return *this;
+  }
+
+  mapped_array_t& operator=(mapped_array_t &&array) {
+    m_values = std::move(array.m_values);
+    m_mapping = std::move(array.m_mapping);
+    m_data = array.m_data;
+    m_size = array.m_size;
+    bind();
+    return *this;
+  }
+
+  inline size_t size() const {
+    return m_size;
+  }
+
+  inline const T *data() const {
+    return m_data;
+  }
+
+  inline const T &operator[](const size_t i) const {
+    return m_data[i];
+  }
+
+  // Whether the values lie in a mapping
+  inline bool mapped() const {
+    return m_mapping != nullptr;
+  }
+
+  // The size and the padding up to the alignment, counting from where the
+  // stream is, followed by the values
+  size_t serialize(std::ostream &out, const size_t alignment = sizeof(T)) const {
+    const std::streamoff position = out.tellp();
+    const uint64_t padding = (position < 0) ? 0 :
+      (alignment - (static_cast<uint64_t>(position) + 2 * sizeof(uint64_t)) % alignment) % alignment;
+
+    size_t written = sdsl::write_member(static_cast<uint64_t>(m_size), out);
+    written += sdsl::write_member(padding, out);
+    for (uint64_t i = 0; i < padding; i++) {
+      out.put('\0');
+    }
+    out.write(reinterpret_cast<const char*>(m_data), static_cast<std::streamsize>(m_size * sizeof(T)));
+
+    return written + padding + m_size * sizeof(T);
+  }
+
+  void load(std::istream &in) {
+    uint64_t size, padding;
+    sdsl::read_member(size, in);
+    sdsl::read_member(padding, in);
+    in.ignore(static_cast<std::streamsize>(padding));
+
+    memory_buffer_t *buffer = dynamic_cast<memory_buffer_t*>(in.rdbuf());
+    const char *data = (buffer != nullptr) ? buffer->take(size * sizeof(T)) : nullptr;
+    if (data != nullptr && reinterpret_cast<uintptr_t>(data) % alignof(T) == 0) {
+      m_values = std::vector<T, allocator_t>();
+      m_mapping = buffer->mapping();
+      m_data = reinterpret_cast<const T*>(data);
+      m_size = static_cast<size_t>(size);
+      return;
+    }
+
+    m_values = std::vector<T, allocator_t>(static_cast<size_t>(size));
+    m_mapping.reset();
+    if (data != nullptr) {
+      std::copy(data, data + size * sizeof(T), reinterpret_cast<char*>(m_values.data()));
+    } else {
+      in.read(reinterpret_cast<char*>(m_values.data()), static_cast<std::streamsize>(size * sizeof(T)));
+    }
+    bind();
+  }
+
+private:
+  void bind() {
+    if (m_mapping == nullptr) {
+      m_data = m_values.data();
+      m_size = m_values.size();
+    }
+  }
+
+  std::vector<T, allocator_t> m_values;
+  std::shared_ptr<const mapping_t> m_mapping;
+  const T *m_data;
+  size_t m_size;
+};
+
+// Integers of a fixed width packed into words like in sdsl::int_vector,
+// with the words in a mapped_array_t
+class mapped_ints_t {
+public:
+  mapped_ints_t() : m_size(0), m_width(64) {}
+
+  template<uint8_t width>
+  explicit mapped_ints_t(const sdsl::int_vector<width> &values) :
+      m_words(std::vector<uint64_t>(values.data(), values.data() + (values.bit_size() + 63) / 64)),
+      m_size(values.size()), m_width(values.width()) {}
+
+  inline size_t size() const {
+    return m_size;
+  }
+
+  inline uint64_t operator[](const size_t i) const {
+    const size_t bit = i * m_width;
+    const size_t word = bit / 64, offset = bit % 64;
+
+    uint64_t value = m_words[word] >> offset;
+    if (offset + m_width > 64) {
+      value |= m_words[word + 1] << (64 - offset);
+    }
+    return (m_width == 64) ? value : value & ((1ULL << m_width) - 1);
+  }
+
+  size_t serialize(std::ostream &out, sdsl::structure_tree_node * = nullptr,
+      std::string = "") const {
+    size_t written = sdsl::write_member(static_cast<uint64_t>(m_size), out);
+    written += sdsl::write_member(static_cast<uint64_t>(m_width), out);
+    written += m_words.serialize(out);
+    return written;
+  }
+
+  void load(std::istream &in) {
+    uint64_t size, width;
+    sdsl::read_member(size, in);
+    sdsl::read_member(width, in);
+    m_size = static_cast<size_t>(size);
+    m_width = static_cast<size_t>(width);
+    m_words.load(in);
+  }
+
+private:
+  mapped_array_t<uint64_t> m_words;
+  size_t m_size;
+  size_t m_width;
+};
+
+#endif
@@ -0,0 +1,125 @@
+// Copyright 2017 Riku Walve
+
+#ifndef WANDA_MEMORY_H_
+#define WANDA_MEMORY_H_
+
+#include <cctype>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+// Share of a cgroup limit used as the budget, leaving room for the
+// allocator and the parts that are not accounted for
+#define CGROUP_BUDGET_PERCENT 90
+
+// Parses a memory size such as "512M" or "16G", without a suffix in MiB
+static inline long parse_memory(const std::string &size) {
+  size_t end = 0;
+  long value = 0;
+  try {
+    value = std::stol(size, &end);
+  } catch (...) {
+    end = 0;
+  }
+
+  if (end == 0 || value <= 0 || end + 1 < size.size()) {
+    std::cerr << "[E::" << __func__ << "]: Invalid memory size \"" << size << "\"!" << std::endl;
+    exit(1);
+  }
+
+  switch (end < size.size() ? std::toupper(size[end]) : 'M') {
+    case 'K': return value << 10;
+    case 'M': return value << 20;
+    case 'G': return value << 30;
+    case 'T': return value << 40;
+    default:
+      std::cerr << "[E::" << __func__ << "]: Invalid memory size \"" << size << "\"!" << std::endl;
+      exit(1);
+  }
+}
+
+// Reads a limit in bytes from a cgroup file, returning 0 if there is none
+static inline long read_cgroup_limit(const std::string &filename) {
+  std::ifstream in(filename);
+  std::string limit;
+  if (!(in >> limit) || limit == "max") {
+    return 0;
+  }
+
+  try {
+    // cgroup v1 reports an unlimited group as a huge page-aligned value
+    const unsigned long long bytes = std::stoull(limit);
+    return (bytes >= (1ULL << 60)) ? 0 : static_cast<long>(bytes);
+  } catch (...) {
+    return 0;
+  }
+}
+
+// The smallest limit in a file of a cgroup and of its ancestors, as a
+// group is also bound by the groups above it, or 0 if there is none
+static inline long read_cgroup_limits(const std::string &root, std::string path,
+    const std::string &file) {
+  long limit = 0;
+  while (true) {
+    const long group = read_cgroup_limit(root + path + "/" + file);
+    if (group > 0 && (limit == 0 || group < limit)) {
+      limit = group;
+    }
+
+    const size_t slash = path.rfind('/');
+    if (path.empty() || slash == std::string::npos) {
+      return limit;
+    }
+    path = path.substr(0, slash);
+  }
+}
+
+// The memory limit of the cgroup of the process, or 0 if there is none. The
+// group is the one in /proc/self/cgroup, with a line "0::<path>" on cgroup
+// v2 and "<id>:<controllers>:<path>" listing memory on cgroup v1.
+static inline long cgroup_memory_limit() {
+  std::ifstream in("/proc/self/cgroup");
+  std::string line;
+  while (std::getline(in, line)) {
+    const size_t first = line.find(':');
+    const size_t second = (first == std::string::npos) ? first : line.find(':', first + 1);
+    if (second == std::string::npos) {
+      continue;
+    }
+
+    const std::string controllers = "," + line.substr(first + 1, second - first - 1) + ",";
+    std::string path = line.substr(second + 1);
+    if (!path.empty() && path.back() == '/') {
+      path.pop_back();
+    }
+
+    long limit = 0;
+    if (line.compare(0, first, "0") == 0 && controllers == ",,") {
+      limit = read_cgroup_limits("/sys/fs/cgroup", path, "memory.max");
+    } else if (controllers.find(",memory,") != std::string::npos) {
+      limit = read_cgroup_limits("/sys/fs/cgroup/memory", path, "memory.limit_in_bytes");
+    }
+
+    if (limit > 0) {
+      return limit;
+    }
+  }
+
+  // Without the group of the process, as in some containers, the group at
+  // the root of the mount is the one of the process
+  const long v2 = read_cgroup_limit("/sys/fs/cgroup/memory.max");
+  if (v2 > 0) {
+    return v2;
+  }
+
+  return read_cgroup_limit("/sys/fs/cgroup/memory/memory.limit_in_bytes");
+}
+
+// The budget when none is given: CGROUP_BUDGET_PERCENT of the cgroup memory
+// limit if there is one, and the fallback otherwise
+static inline long default_ram_use(const long fallback) {
+  const long limit = cgroup_memory_limit();
+  return (limit > 0) ? limit / 100 * CGROUP_BUDGET_PERCENT : fallback;
+}
+
+#endif
@@ -0,0 +1,145 @@
+// Copyright 2017 Riku Walve
+
+#ifndef WANDA_PACKED_TEXT_H_
+#define WANDA_PACKED_TEXT_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sdsl/bit_vectors.hpp>
+
+#include "mapped.h"
+#include "sparse.h"
+
+// Symbols per word of the packed text
+#define PACKED_SYMBOLS 32
+
+// Bytes of the text read at a time when packing a file
+#define PACKED_BUFFER_SIZE (1 << 20)
+
+// A copy of the text with A, C, G and T in 2 bits each, 32 to a word, so
+// that a substring of length l is read from l / 32 + 1 words. The other
+// symbols, like the separators, are rare and kept aside like in the dna
+// backend, and their slots in the words hold an A.
+class packed_text_t {
+public:
+  packed_text_t() : m_size(0) {}
+
+  // Packs a text file, appended to the text of another packed text
+  explicit packed_text_t(const std::string &filename, const packed_text_t &prefix = packed_text_t()) :
+      m_size(0) {
+    std::ifstream in(filename, std::ios::binary | std::ios::ate);
+    if (!in.good()) {
+      std::cerr << "[E::" << __func__ << "]: Unable to read \"" << filename << "\"!" << std::endl;
+      exit(1);
+    }
+
+    const size_t length = static_cast<size_t>(in.tellg());
+    in.seekg(0);
+
+    const size_t n = prefix.size() + length;
+    std::vector<uint64_t> words(n / PACKED_SYMBOLS + 1, 0);
+
+    sdsl::bit_vector rare(n, 0);
+    std::vector<uint8_t> exceptions;
+
+    std::vector<char> buffer(PACKED_BUFFER_SIZE);
+    for (size_t i = 0; i < prefix.size(); i += buffer.size()) {
+      const size_t count = prefix.extract(i, buffer.size(), buffer.data());
+      append(buffer.data(), count, &words, &rare, &exceptions);
+    }
+
+    while (m_size < n) {
+      const size_t count = std::min(buffer.size(), n - m_size);
+      in.read(buffer.data(), static_cast<std::streamsize>(count));
+      append(buffer.data(), count, &words, &rare, &exceptions);
+    }
+
+    m_words = mapped_array_t<uint64_t>(std::move(words));
+    m_rare = rare_symbols_t(rare, exceptions);
+  }
+
+  inline size_t size() const {
+    return m_size;
+  }
+
+  inline bool empty() const {
+    return m_size == 0;
+  }
+
+  // Reads up to length symbols from a position, stopping at the end of the
+  // text, and returns the number of symbols read
+  size_t extract(const size_t position, const size_t length, char *symbols) const {
+    static const char decode[4] = { 'A', 'C', 'G', 'T' };
+
+    const size_t end = std::min(m_size, position + length);
+    if (position >= end) {
+      return 0;
+    }
+
+    size_t i = position;
+    uint64_t word = m_words[i / PACKED_SYMBOLS] >> (2 * (i % PACKED_SYMBOLS));
+    while (i < end) {
+      symbols[i - position] = decode[word & 3];
+      word >>= 2;
+      if (++i % PACKED_SYMBOLS == 0 && i < end) {
+        word = m_words[i / PACKED_SYMBOLS];
+      }
+    }
+
+    const size_t last = m_rare.rank(end);
+    for (size_t r = m_rare.rank(position); r < last; r++) {
+      symbols[m_rare.position(r) - position] = static_cast<char>(m_rare.symbol(r));
+    }
+
+    return end - position;
+  }
+
+  size_t serialize(std::ostream &out, sdsl::structure_tree_node * = nullptr,
+      std::string = "") const {
+    size_t written = sdsl::write_member(m_size, out);
+    written += m_words.serialize(out);
+
+    written += m_rare.serialize(out);
+    return written;
+  }
+
+  void load(std::istream &in) {
+    sdsl::read_member(m_size, in);
+    m_words.load(in);
+
+    m_rare.load(in);
+  }
+
+private:
+  void append(const char *buffer, const size_t count, std::vector<uint64_t> *words,
+      sdsl::bit_vector *rare, std::vector<uint8_t> *exceptions) {
+    for (size_t j = 0; j < count; j++, m_size++) {
+      uint64_t s;
+      switch (buffer[j]) {
+        case 'A': s = 0; break;
+        case 'C': s = 1; break;
+        case 'G': s = 2; break;
+        case 'T': s = 3; break;
+        default:
+          (*rare)[m_size] = 1;
+          exceptions->push_back(static_cast<uint8_t>(buffer[j]));
+          s = 0;
+      }
+
+      (*words)[m_size / PACKED_SYMBOLS] |= s << (2 * (m_size % PACKED_SYMBOLS));
+    }
+  }
+
+  size_t m_size;
+  mapped_array_t<uint64_t> m_words;
+
+  // The symbols other than A, C, G and T
+  rare_symbols_t m_rare;
+};
+
+#endif
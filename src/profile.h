@@ -0,0 +1,348 @@
+// Copyright 2017 Riku Walve
+
+#ifndef WANDA_PROFILE_H_
+#define WANDA_PROFILE_H_
+
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Interval between samples of the temporary disk usage in milliseconds
+#define PROFILE_SAMPLE_INTERVAL 100
+
+// Records the wall time, CPU time, peak RSS, I/O volume and temporary disk
+// usage of named phases, and writes them as JSON to the file named by the
+// WANDA_PROFILE environment variable at exit. Phases may be nested. Without
+// the variable, nothing is measured.
+//
+// Phases are only opened and closed by the thread that created the
+// profiler, which is the main thread, so they nest in the order they are
+// opened. Threads started inside a phase are measured as part of it.
+class profiler_t {
+public:
+  static profiler_t &instance() {
+    static profiler_t profiler;
+    return profiler;
+  }
+
+  ~profiler_t() {
+    if (!m_enabled) return;
+
+    stop_sampler();
+    while (!m_open.empty()) end();
+
+    write_report();
+  }
+
+  inline bool enabled() const {
+    return m_enabled;
+  }
+
+  // Stops measuring without writing a report, for forked processes whose
+  // parent reports the phase they run in
+  void disable() {
+    m_enabled = false;
+  }
+
+  // Counts the files whose paths start with a prefix as temporary files,
+  // like the files written next to a stream or a graph
+  void watch(const std::string &prefix) {
+    if (!m_enabled) return;
+
+    std::unique_lock<std::mutex> lk(m_mutex);
+    m_prefixes.push_back(prefix);
+  }
+
+  void begin(const std::string &name) {
+    if (!m_enabled) return;
+    assert(std::this_thread::get_id() == m_owner);
+
+    std::unique_lock<std::mutex> lk(m_mutex);
+
+    // The peak RSS is reset for every phase, so the enclosing phases take
+    // the peak so far with them
+    update_peaks(peak_rss());
+    reset_peak_rss();
+
+    open_phase_t phase;
+    phase.name = name;
+    phase.wall = wall_time();
+    phase.cpu = cpu_time();
+    read_io(&phase.io);
+    phase.peak_rss = current_rss();
+    phase.disk_start = disk_usage();
+    phase.disk_peak = phase.disk_start;
+    m_open.push_back(phase);
+
+    if (m_sampler == nullptr && !m_prefixes.empty()) {
+      m_sampler = new std::thread(sampler_thread_code, this);
+    }
+  }
+
+  void end() {
+    if (!m_enabled) return;
+    assert(std::this_thread::get_id() == m_owner);
+
+    std::unique_lock<std::mutex> lk(m_mutex);
+    if (m_open.empty()) return;
+
+    update_peaks(peak_rss());
+
+    const open_phase_t &phase = m_open.back();
+    io_t io;
+    read_io(&io);
+
+    record_t record;
+    record.name = phase.name;
+    record.depth = m_open.size() - 1;
+    record.start = phase.wall - m_start;
+    record.wall = wall_time() - phase.wall;
+    record.cpu = cpu_time() - phase.cpu;
+    record.peak_rss = phase.peak_rss;
+    for (size_t i = 0; i < IO_FIELDS; i++) {
+      record.io.values[i] = io.values[i] - phase.io.values[i];
+    }
+    record.temp_disk = std::max(0L, std::max(phase.disk_peak, disk_usage()) - phase.disk_start);
+
+    m_records.push_back(record);
+    m_open.pop_back();
+  }
+
+private:
+  // Fields of /proc/self/io: bytes passed to read and write calls, and bytes
+  // actually read from and written to storage
+  enum { IO_FIELDS = 4 };
+
+  struct io_t {
+    long values[IO_FIELDS] = { 0, 0, 0, 0 };
+  };
+
+  struct open_phase_t {
+    std::string name;
+    double wall, cpu;
+    io_t io;
+    long peak_rss;
+    long disk_start, disk_peak;
+  };
+
+  struct record_t {
+    std::string name;
+    size_t depth;
+    double start, wall, cpu;
+    io_t io;
+    long peak_rss;
+    long temp_disk;
+  };
+
+  profiler_t() : m_start(0), m_peak_rss(0), m_owner(std::this_thread::get_id()),
+      m_sampler(nullptr), m_finished(false) {
+    const char *filename = std::getenv("WANDA_PROFILE");
+    m_enabled = (filename != nullptr && filename[0] != '\0');
+    if (m_enabled) {
+      m_filename = filename;
+      m_start = wall_time();
+    }
+  }
+
+  profiler_t(const profiler_t&) = delete;
+  profiler_t& operator=(const profiler_t&) = delete;
+
+  static void sampler_thread_code(profiler_t *profiler) {
+    std::unique_lock<std::mutex> lk(profiler->m_mutex);
+    while (!profiler->m_finished) {
+      const long usage = profiler->disk_usage();
+      for (size_t i = 0; i < profiler->m_open.size(); i++) {
+        profiler->m_open[i].disk_peak = std::max(profiler->m_open[i].disk_peak, usage);
+      }
+
+      profiler->m_cv.wait_for(lk, std::chrono::milliseconds(PROFILE_SAMPLE_INTERVAL));
+    }
+  }
+
+  void stop_sampler() {
+    if (m_sampler == nullptr) return;
+
+    std::unique_lock<std::mutex> lk(m_mutex);
+    m_finished = true;
+    lk.unlock();
+    m_cv.notify_one();
+
+    m_sampler->join();
+    delete m_sampler;
+    m_sampler = nullptr;
+  }
+
+  void update_peaks(const long rss) {
+    for (size_t i = 0; i < m_open.size(); i++) {
+      m_open[i].peak_rss = std::max(m_open[i].peak_rss, rss);
+    }
+    m_peak_rss = std::max(m_peak_rss, rss);
+  }
+
+  static double wall_time() {
+    return std::chrono::duration<double>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  // User and system time of the process and its waited-for children
+  static double cpu_time() {
+    double seconds = 0;
+    const int who[] = { RUSAGE_SELF, RUSAGE_CHILDREN };
+    for (size_t i = 0; i < 2; i++) {
+      struct rusage usage;
+      getrusage(who[i], &usage);
+      seconds += static_cast<double>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+        static_cast<double>(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    }
+    return seconds;
+  }
+
+  // Reads a field of /proc/self/status in bytes
+  static long status_field(const std::string &field) {
+    std::ifstream in("/proc/self/status");
+    std::string key;
+    long value;
+    while (in >> key) {
+      if (key == field + ":" && in >> value) {
+        return value << 10;
+      }
+      in.ignore(256, '\n');
+    }
+    return 0;
+  }
+
+  static long peak_rss() {
+    return status_field("VmHWM");
+  }
+
+  static long current_rss() {
+    return status_field("VmRSS");
+  }
+
+  static void reset_peak_rss() {
+    std::ofstream out("/proc/self/clear_refs");
+    out << "5";
+  }
+
+  static void read_io(io_t *io) {
+    static const char *fields[IO_FIELDS] = { "rchar:", "wchar:", "read_bytes:", "write_bytes:" };
+
+    std::ifstream in("/proc/self/io");
+    std::string key;
+    long value;
+    while (in >> key >> value) {
+      for (size_t i = 0; i < IO_FIELDS; i++) {
+        if (key == fields[i]) io->values[i] = value;
+      }
+    }
+  }
+
+  // Space allocated to the files starting with the watched prefixes. Only
+  // the directories of the prefixes are listed, so files of other programs
+  // on the same file system do not count.
+  long disk_usage() const {
+    long usage = 0;
+    for (size_t i = 0; i < m_prefixes.size(); i++) {
+      const size_t slash = m_prefixes[i].rfind('/');
+      const std::string directory = (slash == std::string::npos) ? "." :
+        m_prefixes[i].substr(0, slash + 1);
+      const std::string name = m_prefixes[i].substr((slash == std::string::npos) ? 0 : slash + 1);
+
+      DIR *dir = opendir(directory.c_str());
+      if (dir == nullptr) continue;
+
+      for (struct dirent *entry = readdir(dir); entry != nullptr; entry = readdir(dir)) {
+        const std::string file = entry->d_name;
+        struct stat st;
+        if (file.compare(0, name.size(), name) == 0 &&
+            stat((directory + "/" + file).c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+          usage += static_cast<long>(st.st_blocks) * 512;
+        }
+      }
+      closedir(dir);
+    }
+
+    return usage;
+  }
+
+  void write_report() const {
+    std::ofstream out(m_filename);
+    if (!out.good()) {
+      std::cerr << "[E::" << __func__ << "]: Unable to write to \"" << m_filename << "\"!" << std::endl;
+      return;
+    }
+
+    out << "{\n  \"wall\": " << (wall_time() - m_start) <<
+      ",\n  \"cpu\": " << cpu_time() <<
+      ",\n  \"peak_rss\": " << std::max(m_peak_rss, peak_rss()) <<
+      ",\n  \"phases\": [";
+
+    // Phases are recorded as they end, so they are reported by start time
+    std::vector<const record_t*> records;
+    for (size_t i = 0; i < m_records.size(); i++) {
+      records.push_back(&m_records[i]);
+    }
+    std::stable_sort(records.begin(), records.end(),
+      [](const record_t *a, const record_t *b) { return a->start < b->start; });
+
+    for (size_t i = 0; i < records.size(); i++) {
+      const record_t &r = *records[i];
+      out << (i > 0 ? "," : "") << "\n    { " <<
+        "\"name\": \"" << r.name << "\", " <<
+        "\"depth\": " << r.depth << ", " <<
+        "\"start\": " << r.start << ", " <<
+        "\"wall\": " << r.wall << ", " <<
+        "\"cpu\": " << r.cpu << ", " <<
+        "\"peak_rss\": " << r.peak_rss << ", " <<
+        "\"read\": " << r.io.values[0] << ", " <<
+        "\"written\": " << r.io.values[1] << ", " <<
+        "\"disk_read\": " << r.io.values[2] << ", " <<
+        "\"disk_written\": " << r.io.values[3] << ", " <<
+        "\"temp_disk\": " << r.temp_disk << " }";
+    }
+    out << "\n  ]\n}\n";
+  }
+
+  bool m_enabled;
+  std::string m_filename;
+  std::vector<std::string> m_prefixes;
+  double m_start;
+  long m_peak_rss;
+
+  // The thread opening and closing the phases
+  std::thread::id m_owner;
+
+  std::vector<open_phase_t> m_open;
+  std::vector<record_t> m_records;
+
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  std::thread *m_sampler;
+  bool m_finished;
+};
+
+// Measures a phase for as long as it is in scope
+class phase_t {
+public:
+  explicit phase_t(const std::string &name) {
+    profiler_t::instance().begin(name);
+  }
+
+  ~phase_t() {
+    profiler_t::instance().end();
+  }
+};
+
+#endif
@@ -0,0 +1,71 @@
+// Copyright 2017 Riku Walve
+
+#ifndef WANDA_PSI_H_
+#define WANDA_PSI_H_
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+#include <sdsl/bit_vectors.hpp>
+
+#include "sparse.h"
+
+// Ψ, the inverse of LF, as one increasing sequence. The row of the i-th
+// occurrence of code c in the BWT is C[c] + i, so listing the occurrences
+// of every code in the order of the codes lists the rows in order. Storing
+// the occurrence at position p of code c as c * n + p in a sparse bitvector
+// makes Ψ(i) the (i + 1)-th set bit, found in constant time, and the first
+// symbol of the row falls out of the same value. It takes about
+// 2 + log(sigma) bits per row.
+class psi_t {
+public:
+  psi_t() : m_size(0) {}
+
+  // From a BWT over dense codes, read once per code
+  template<class bwt_t>
+  psi_t(bwt_t &bwt, const size_t n, const size_t sigma) : m_size(n) {
+    sdsl::sd_vector_builder<> builder(sigma * n, n);
+    for (size_t c = 0; c < sigma; c++) {
+      for (size_t p = 0; p < n; p++) {
+        if (static_cast<size_t>(bwt[p]) == c) {
+          builder.set(c * n + p);
+        }
+      }
+    }
+
+    m_values = sparse_vector_t(builder);
+  }
+
+  // Whether Ψ was stored at all
+  inline bool empty() const {
+    return m_size == 0;
+  }
+
+  // The row of the next suffix in text order, and the code of the first
+  // symbol of the row
+  inline size_t operator()(const size_t i, uint8_t *c) const {
+    const uint64_t value = m_values.select(i + 1);
+    const uint64_t code = value / m_size;
+    *c = static_cast<uint8_t>(code);
+    return static_cast<size_t>(value - code * m_size);
+  }
+
+  size_t serialize(std::ostream &out, sdsl::structure_tree_node * = nullptr,
+      std::string = "") const {
+    size_t written = sdsl::write_member(m_size, out);
+    written += m_values.serialize(out);
+    return written;
+  }
+
+  void load(std::istream &in) {
+    sdsl::read_member(m_size, in);
+    m_values.load(in);
+  }
+
+private:
+  size_t m_size;
+  sparse_vector_t m_values;
+};
+
+#endif
@@ -0,0 +1,180 @@
+// Copyright 2017 Riku Walve
+
+#ifndef WANDA_RLE_BWT_H_
+#define WANDA_RLE_BWT_H_
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sdsl/bit_vectors.hpp>
+#include <sdsl/wavelet_trees.hpp>
+
+#include "sparse.h"
+
+// Run-length compressed BWT with the interface of the sdsl wavelet trees
+// the index uses. Like in the r-index, the symbols of the runs are kept in
+// a wavelet tree, the starts of the runs in a sparse bitvector, and the
+// lengths of the runs of each symbol in a sparse bitvector over the
+// occurrences of that symbol, so the size depends on the number of runs r
+// rather than on the length of the BWT.
+//
+// The run lengths of all symbols share one bitvector, where the symbol c
+// has a segment of count(c) + 1 bits starting at m_base[c]. The bits mark
+// the starts of its runs among its occurrences, and the end of the last run.
+class rle_wt_t {
+public:
+  typedef uint64_t size_type;
+  typedef uint8_t value_type;
+
+  // Number of distinct symbols
+  size_type sigma;
+
+  rle_wt_t() : sigma(0), m_size(0), m_base(257, 0), m_ones(257, 0) {}
+
+  template<uint8_t width>
+  rle_wt_t(sdsl::int_vector_buffer<width> &buffer, const size_type size) :
+      sigma(0), m_size(size), m_base(257, 0), m_ones(257, 0) {
+    std::vector<size_type> counts(256, 0);
+    std::vector<std::vector<uint64_t> > symbol_runs(256);
+    std::vector<uint8_t> heads;
+    std::vector<uint64_t> starts;
+
+    for (size_type i = 0; i < size; i++) {
+      const uint8_t c = static_cast<uint8_t>(buffer[i]);
+      if (i == 0 || c != heads.back()) {
+        heads.push_back(c);
+        starts.push_back(i);
+        symbol_runs[c].push_back(counts[c]);
+      }
+      counts[c]++;
+    }
+
+    // The end of the last run, so that every run has a successor
+    starts.push_back(size);
+    m_starts = sparse_vector_t(starts.begin(), starts.end());
+    std::vector<uint64_t>().swap(starts);
+
+    std::vector<uint64_t> lengths;
+    for (size_t c = 0; c < 256; c++) {
+      m_base[c + 1] = m_base[c] + counts[c] + 1;
+      m_ones[c + 1] = m_ones[c] + symbol_runs[c].size() + 1;
+      for (size_t j = 0; j < symbol_runs[c].size(); j++) {
+        lengths.push_back(m_base[c] + symbol_runs[c][j]);
+      }
+      lengths.push_back(m_base[c] + counts[c]);
+
+      sigma += (counts[c] > 0);
+    }
+    m_lengths = sparse_vector_t(lengths.begin(), lengths.end());
+
+    sdsl::int_vector<8> symbols(heads.size());
+    for (size_t j = 0; j < heads.size(); j++) {
+      symbols[j] = heads[j];
+    }
+    sdsl::construct_im(m_heads, symbols);
+  }
+
+  inline size_type size() const {
+    return m_size;
+  }
+
+  // Number of runs
+  inline size_type runs() const {
+    return m_heads.size();
+  }
+
+  inline value_type operator[](const size_type i) const {
+    return static_cast<value_type>(m_heads[m_starts.rank(i + 1) - 1]);
+  }
+
+  // Occurrences of c in [0, i)
+  size_type rank(const size_type i, const value_type c) const {
+    if (i == 0) return 0;
+
+    // The run holding i - 1 and the runs of c up to it
+    const size_type j = m_starts.rank(i) - 1;
+    const size_type k = m_heads.rank(j + 1, c);
+    if (k == 0) return 0;
+
+    if (m_heads[j] == c) {
+      return preceding(c, k - 1) + (i - m_starts.select(j + 1));
+    }
+
+    return preceding(c, k);
+  }
+
+  // Position of the i-th occurrence of c, counting from 1
+  size_type select(const size_type i, const value_type c) const {
+    // The run of c holding the occurrence
+    const size_type k = m_lengths.rank(m_base[c] + i) - m_ones[c];
+    const size_type offset = (i - 1) - preceding(c, k - 1);
+
+    return m_starts.select(m_heads.select(k, c) + 1) + offset;
+  }
+
+  // For each symbol c in [i, j), its rank at i and at j, like the sdsl trees
+  template<class t_cs, class t_ranks>
+  void interval_symbols(const size_type i, const size_type j, size_type &k, t_cs &cs,
+      t_ranks &rank_c_i, t_ranks &rank_c_j) const {
+    // The symbols are those of the runs overlapping the range
+    const size_type first = m_starts.rank(i + 1) - 1;
+    const size_type last = m_starts.rank(j) - 1;
+    m_heads.interval_symbols(first, last + 1, k, cs, rank_c_i, rank_c_j);
+
+    for (size_type t = 0; t < k; t++) {
+      rank_c_i[t] = rank(i, static_cast<value_type>(cs[t]));
+      rank_c_j[t] = rank(j, static_cast<value_type>(cs[t]));
+    }
+  }
+
+  size_type serialize(std::ostream &out, sdsl::structure_tree_node * = nullptr,
+      std::string = "") const {
+    size_type written = sdsl::write_member(m_size, out);
+    written += sdsl::write_member(sigma, out);
+    written += m_heads.serialize(out);
+    written += m_starts.serialize(out);
+    written += m_lengths.serialize(out);
+    for (size_t c = 0; c < m_base.size(); c++) {
+      written += sdsl::write_member(m_base[c], out);
+      written += sdsl::write_member(m_ones[c], out);
+    }
+    return written;
+  }
+
+  void load(std::istream &in) {
+    sdsl::read_member(m_size, in);
+    sdsl::read_member(sigma, in);
+    m_heads.load(in);
+    m_starts.load(in);
+    m_lengths.load(in);
+    for (size_t c = 0; c < m_base.size(); c++) {
+      sdsl::read_member(m_base[c], in);
+      sdsl::read_member(m_ones[c], in);
+    }
+  }
+
+private:
+  // Total length of the first k runs of c
+  inline size_type preceding(const value_type c, const size_type k) const {
+    return m_lengths.select(m_ones[c] + k + 1) - m_base[c];
+  }
+
+  size_type m_size;
+
+  // Symbol of each run
+  sdsl::wt_huff<> m_heads;
+
+  // Start of each run, and the end of the BWT
+  sparse_vector_t m_starts;
+
+  // Starts of the runs of each symbol among its occurrences
+  sparse_vector_t m_lengths;
+
+  // Start of the segment of each symbol, and the number of bits set before it
+  std::vector<size_type> m_base;
+  std::vector<size_type> m_ones;
+};
+
+#endif
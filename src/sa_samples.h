@@ -0,0 +1,315 @@
+// Copyright 2017 Riku Walve
+
+#ifndef WANDA_SA_SAMPLES_H_
+#define WANDA_SA_SAMPLES_H_
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sdsl/bit_vectors.hpp>
+#include <sdsl/int_vector.hpp>
+
+#include "mapped.h"
+#include "sparse.h"
+
+// Default distance between sampled text positions
+#define SA_SAMPLE_DENSITY 32
+
+// A text of the index. Merged indexes hold the texts of both sides one
+// after the other. The samples of a text are numbered from base onwards.
+struct sa_text_t {
+  uint64_t position;
+  uint64_t base;
+
+  // Rows of the suffixes at the first and the last position of the text
+  uint64_t start_row;
+  uint64_t end_row;
+};
+
+// Suffix array samples at every density-th position of each text, counting
+// from the start of the text. A sparse bitvector marks the rows of the
+// sampled suffixes, and the numbers of the samples are kept bit-compressed
+// in row order. Walking LF from any row reaches a sampled row in less than
+// density steps, and the start of the text is always sampled, so a walk
+// never wraps around.
+class sa_samples_t {
+public:
+  sa_samples_t() : m_density(SA_SAMPLE_DENSITY) {}
+
+  sa_samples_t(const size_t density, const sdsl::bit_vector &marks, const sdsl::int_vector<> &values,
+      std::vector<sa_text_t> texts) :
+      m_density(density), m_marks(marks), m_values(values), m_texts(std::move(texts)) {
+    index_texts();
+  }
+
+  inline size_t density() const {
+    return m_density;
+  }
+
+  // Number of samples
+  inline size_t size() const {
+    return m_values.size();
+  }
+
+  inline const std::vector<sa_text_t> &texts() const {
+    return m_texts;
+  }
+
+  // The number of the sample of a row, if it is sampled
+  inline bool sample(const size_t row, size_t *number) const {
+    if (!m_marks[row]) {
+      return false;
+    }
+
+    *number = m_values[m_marks.rank(row)];
+    return true;
+  }
+
+  // The position of the suffix of a row, if it is sampled
+  inline bool lookup(const size_t row, size_t *position) const {
+    size_t number;
+    if (!sample(row, &number)) {
+      return false;
+    }
+
+    const size_t t = static_cast<size_t>(std::upper_bound(m_bases.begin(), m_bases.end(),
+      number) - m_bases.begin()) - 1;
+
+    *position = m_texts[t].position + (number - m_texts[t].base) * m_density;
+    return true;
+  }
+
+  // LF of a row preceded by the last symbol of the texts, given its rank
+  // among those rows and the first row starting with the symbol. The
+  // suffixes are sorted without wrapping around the texts, so the start of
+  // a text goes to the end of the text before it, and the other rows skip
+  // the ends.
+  size_t wrap(const size_t row, const size_t rank, const size_t first) const {
+    const size_t starts = this->starts(row);
+    if (starts < m_starts.size() && m_starts[starts] == row) {
+      const size_t t = m_start_texts[starts];
+      return m_texts[(t + m_texts.size() - 1) % m_texts.size()].end_row;
+    }
+
+    return place(rank - starts, first);
+  }
+
+  // The same for the rows of other texts, which only skip the starts and
+  // the ends
+  size_t skip(const size_t row, const size_t rank, const size_t first) const {
+    return place(rank - starts(row), first);
+  }
+
+  // The inverse of wrap for a row starting with the last symbol of the
+  // texts. The end of a text goes to the start of the text after it, which
+  // is returned as true. The other rows give their rank among the rows
+  // preceded by the symbol, leaving out the starts.
+  bool unwrap(const size_t row, const size_t first, size_t *result) const {
+    const size_t ends = static_cast<size_t>(std::lower_bound(m_ends.begin(), m_ends.end(), row) -
+      m_ends.begin());
+    if (ends < m_ends.size() && m_ends[ends] == row) {
+      *result = m_texts[(m_end_texts[ends] + 1) % m_texts.size()].start_row;
+      return true;
+    }
+
+    *result = row - first - ends;
+    return false;
+  }
+
+  // Number of texts starting in the rows before a row
+  inline size_t starts(const size_t row) const {
+    return static_cast<size_t>(std::lower_bound(m_starts.begin(), m_starts.end(), row) -
+      m_starts.begin());
+  }
+
+  // The row of a rank among the rows preceded by the last symbol of the
+  // texts, given the first row starting with the symbol. The ends of the
+  // texts are preceded by no suffix, so they are skipped. The j-th end is
+  // skipped when it is at most first + rank + j, and its gap to j never
+  // decreases, so the skipped ends are found by a binary search.
+  inline size_t place(const size_t rank, const size_t first) const {
+    return first + rank + static_cast<size_t>(std::upper_bound(m_end_gaps.begin(),
+      m_end_gaps.end(), first + rank) - m_end_gaps.begin());
+  }
+
+  inline bool end(const size_t row) const {
+    return std::binary_search(m_ends.begin(), m_ends.end(), row);
+  }
+
+  size_t serialize(std::ostream &out, sdsl::structure_tree_node * = nullptr,
+      std::string = "") const {
+    size_t written = sdsl::write_member(m_density, out);
+    written += m_marks.serialize(out);
+    written += m_values.serialize(out);
+
+    written += sdsl::write_member(m_texts.size(), out);
+    for (size_t t = 0; t < m_texts.size(); t++) {
+      written += sdsl::write_member(m_texts[t].position, out);
+      written += sdsl::write_member(m_texts[t].base, out);
+      written += sdsl::write_member(m_texts[t].start_row, out);
+      written += sdsl::write_member(m_texts[t].end_row, out);
+    }
+    return written;
+  }
+
+  void load(std::istream &in) {
+    sdsl::read_member(m_density, in);
+    m_marks.load(in);
+    m_values.load(in);
+
+    size_t texts;
+    sdsl::read_member(texts, in);
+    m_texts.resize(texts);
+    for (size_t t = 0; t < texts; t++) {
+      sdsl::read_member(m_texts[t].position, in);
+      sdsl::read_member(m_texts[t].base, in);
+      sdsl::read_member(m_texts[t].start_row, in);
+      sdsl::read_member(m_texts[t].end_row, in);
+    }
+    index_texts();
+  }
+
+private:
+  // Sorts the bases, starts and ends of the texts for binary searches
+  void index_texts() {
+    const size_t texts = m_texts.size();
+    m_bases.resize(texts);
+    m_starts.resize(texts);
+    m_start_texts.resize(texts);
+    m_ends.resize(texts);
+    m_end_texts.resize(texts);
+    m_end_gaps.resize(texts);
+
+    for (size_t t = 0; t < texts; t++) {
+      m_bases[t] = m_texts[t].base;
+      m_start_texts[t] = t;
+      m_end_texts[t] = t;
+    }
+
+    std::sort(m_start_texts.begin(), m_start_texts.end(), [this](const size_t a, const size_t b) {
+      return m_texts[a].start_row < m_texts[b].start_row;
+    });
+    std::sort(m_end_texts.begin(), m_end_texts.end(), [this](const size_t a, const size_t b) {
+      return m_texts[a].end_row < m_texts[b].end_row;
+    });
+
+    for (size_t j = 0; j < texts; j++) {
+      m_starts[j] = m_texts[m_start_texts[j]].start_row;
+      m_ends[j] = m_texts[m_end_texts[j]].end_row;
+      m_end_gaps[j] = m_ends[j] - j;
+    }
+  }
+
+  size_t m_density;
+
+  sparse_vector_t m_marks;
+  mapped_ints_t m_values;
+
+  // Texts in text order, and their bases in the same order
+  std::vector<sa_text_t> m_texts;
+  std::vector<uint64_t> m_bases;
+
+  // Start and end rows in row order, the texts they belong to, and the gap
+  // between each end row and its rank among the ends
+  std::vector<uint64_t> m_starts;
+  std::vector<size_t> m_start_texts;
+  std::vector<uint64_t> m_ends;
+  std::vector<size_t> m_end_texts;
+  std::vector<uint64_t> m_end_gaps;
+};
+
+// Collects the samples in row order, with the numbers packed to their final
+// width from the start
+class sa_samples_builder_t {
+public:
+  sa_samples_builder_t() : m_n(0), m_density(SA_SAMPLE_DENSITY), m_filled(0) {}
+
+  // Room for the samples of up to the given number of texts of total
+  // length n
+  sa_samples_builder_t(const size_t n, const size_t density, const size_t texts = 1) :
+      m_n(n), m_density(density), m_marks(n, 0),
+      m_values(capacity(n, density, texts), 0, sdsl::bits::hi(capacity(n, density, texts)) + 1),
+      m_filled(0) {
+    m_text.position = m_text.base = m_text.start_row = m_text.end_row = 0;
+  }
+
+  // Memory of the builder of a text of length n
+  static size_t size_in_bytes(const size_t n, const size_t density) {
+    const size_t values = capacity(n, density, 1) * (sdsl::bits::hi(capacity(n, density, 1)) + 1);
+    return (n + 63) / 64 * 8 + (values + 63) / 64 * 8;
+  }
+
+  inline size_t density() const {
+    return m_density;
+  }
+
+  inline bool sampled(const size_t position) const {
+    return (position % m_density) == 0;
+  }
+
+  // Marks the row of a position of a single text. Threads may mark rows in
+  // parallel if their ranges do not share words of the bitvector.
+  inline void mark(const size_t row, const size_t position) {
+    if (position == 0) {
+      m_text.start_row = row;
+    } else if (position == m_n - 1) {
+      m_text.end_row = row;
+    }
+
+    if (sampled(position)) {
+      m_marks[row] = 1;
+    }
+  }
+
+  // Appends the number of the next marked row in row order
+  inline void push(const size_t number) {
+    m_values[m_filled++] = number;
+  }
+
+  // Samples the suffix of the next row of a single text
+  inline void add(const size_t row, const size_t position) {
+    mark(row, position);
+    if (sampled(position)) {
+      push(position / m_density);
+    }
+  }
+
+  // Samples a row with a known number
+  inline void add_number(const size_t row, const size_t number) {
+    m_marks[row] = 1;
+    push(number);
+  }
+
+  // The samples of a single text
+  sa_samples_t finish() {
+    return finish(std::vector<sa_text_t>(1, m_text));
+  }
+
+  sa_samples_t finish(std::vector<sa_text_t> texts) {
+    m_values.resize(m_filled);
+    sa_samples_t samples(m_density, m_marks, m_values, std::move(texts));
+    sdsl::util::clear(m_marks);
+    sdsl::util::clear(m_values);
+    return samples;
+  }
+
+private:
+  // Every text adds one sample at most
+  static size_t capacity(const size_t n, const size_t density, const size_t texts) {
+    return n / density + texts;
+  }
+
+  size_t m_n;
+  size_t m_density;
+
+  sdsl::bit_vector m_marks;
+  sdsl::int_vector<> m_values;
+  size_t m_filled;
+
+  sa_text_t m_text;
+};
+
+#endif
@@ -0,0 +1,173 @@
+// Copyright 2017 Riku Walve
+
+#ifndef WANDA_SPARSE_H_
+#define WANDA_SPARSE_H_
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sdsl/bit_vectors.hpp>
+#include <sdsl/int_vector.hpp>
+#include <sdsl/wavelet_trees.hpp>
+
+// Sparse bitvector with rank and select. The supports point to the
+// bitvector, so they are rebuilt whenever it is copied, moved or loaded, and
+// the structures holding one keep the default copies and moves.
+class sparse_vector_t {
+public:
+  sparse_vector_t() {
+    bind();
+  }
+
+  explicit sparse_vector_t(const sdsl::bit_vector &bits) : m_bits(bits) {
+    bind();
+  }
+
+  explicit sparse_vector_t(sdsl::sd_vector_builder<> &builder) : m_bits(builder) {
+    bind();
+  }
+
+  // From the increasing positions of the set bits
+  template<class iterator_t>
+  sparse_vector_t(const iterator_t begin, const iterator_t end) : m_bits(begin, end) {
+    bind();
+  }
+
+  sparse_vector_t(const sparse_vector_t &bits) : m_bits(bits.m_bits) {
+    bind();
+  }
+
+  sparse_vector_t(sparse_vector_t &&bits) : m_bits(std::move(bits.m_bits)) {
+    bind();
+  }
+
+  sparse_vector_t& operator=(const sparse_vector_t &bits) {
+    m_bits = bits.m_bits;
+    bind();
+    return *this;
+  }
+
+  sparse_vector_t& operator=(sparse_vector_t &&bits) {
+    m_bits = std::move(bits.m_bits);
+    bind();
+    return *this;
+  }
+
+  inline size_t size() const {
+    return m_bits.size();
+  }
+
+  inline bool operator[](const size_t i) const {
+    return m_bits[i];
+  }
+
+  // Set bits in [0, i)
+  inline size_t rank(const size_t i) const {
+    return m_rank(i);
+  }
+
+  // Position of the i-th set bit, counting from 1
+  inline size_t select(const size_t i) const {
+    return m_select(i);
+  }
+
+  size_t serialize(std::ostream &out, sdsl::structure_tree_node * = nullptr,
+      std::string = "") const {
+    return m_bits.serialize(out);
+  }
+
+  void load(std::istream &in) {
+    m_bits.load(in);
+    bind();
+  }
+
+private:
+  void bind() {
+    m_rank = sdsl::rank_support_sd<1>(&m_bits);
+    m_select = sdsl::select_support_sd<1>(&m_bits);
+  }
+
+  sdsl::sd_vector<> m_bits;
+  sdsl::rank_support_sd<1> m_rank;
+  sdsl::select_support_sd<1> m_select;
+};
+
+// The rare symbols of a sequence, like the separators of DNA, kept aside
+// from the packed common ones. A sparse bitvector marks their positions and
+// a wavelet tree holds them in position order.
+class rare_symbols_t {
+public:
+  rare_symbols_t() {}
+
+  // From the marked positions and the symbols at them
+  rare_symbols_t(const sdsl::bit_vector &positions, const std::vector<uint8_t> &symbols) :
+      m_positions(positions) {
+    sdsl::int_vector<8> sequence(symbols.size());
+    for (size_t j = 0; j < symbols.size(); j++) {
+      sequence[j] = symbols[j];
+    }
+    sdsl::construct_im(m_symbols, sequence);
+  }
+
+  inline size_t size() const {
+    return m_symbols.size();
+  }
+
+  inline bool empty() const {
+    return m_symbols.size() == 0;
+  }
+
+  inline bool contains(const size_t i) const {
+    return m_positions[i];
+  }
+
+  // Rare symbols in [0, i)
+  inline size_t rank(const size_t i) const {
+    return m_positions.rank(i);
+  }
+
+  // Occurrences of c in [0, i)
+  inline size_t rank(const size_t i, const uint8_t c) const {
+    return m_symbols.rank(m_positions.rank(i), c);
+  }
+
+  // Position of the i-th occurrence of c, counting from 1
+  inline size_t select(const size_t i, const uint8_t c) const {
+    return position(m_symbols.select(i, c));
+  }
+
+  // Position and symbol of the j-th rare symbol, counting from 0
+  inline size_t position(const size_t j) const {
+    return m_positions.select(j + 1);
+  }
+
+  inline uint8_t symbol(const size_t j) const {
+    return static_cast<uint8_t>(m_symbols[j]);
+  }
+
+  // The rare symbols in position order
+  inline const sdsl::wt_huff<> &symbols() const {
+    return m_symbols;
+  }
+
+  size_t serialize(std::ostream &out, sdsl::structure_tree_node * = nullptr,
+      std::string = "") const {
+    size_t written = m_positions.serialize(out);
+    written += m_symbols.serialize(out);
+    return written;
+  }
+
+  void load(std::istream &in) {
+    m_positions.load(in);
+    m_symbols.load(in);
+  }
+
+private:
+  sparse_vector_t m_positions;
+  sdsl::wt_huff<> m_symbols;
+};
+
+#endif
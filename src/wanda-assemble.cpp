@@ -6,21 +6,31 @@
 
 #include "interval.h"
 #include "graph.h"
+#include "profile.h"
 
-void print_path(const graph_t &graph, const std::vector<interval_t> &path) {
+template<class wt_t>
+void print_path(const graph_t<wt_t> &graph, const std::vector<interval_t> &path) {
   // TODO: Print with a lock
 
   if (path.size() == 0) return;
 
-  std::string unitig = graph.label(path[0]);
+  // The path runs backwards, so the unitig is spelled from its end
+  const size_t k = graph.k();
+  std::string unitig(k + path.size() - 1, '\0');
+  if (!graph.label(path[0], &unitig[path.size() - 1])) {
+    unitig.resize(path.size() - 1);
+  }
+
+  std::vector<char> label(k);
   for (size_t i = 1; i < path.size(); i++) {
-    unitig = graph.label(path[i])[0] + unitig;
+    unitig[path.size() - 1 - i] = graph.label(path[i], label.data()) ? label[0] : '\0';
   }
 
   std::cout << unitig << std::endl;
 }
 
-void compute_unitigs(const graph_t &graph, const size_t solid, const size_t min_length) {
+template<class wt_t>
+void compute_unitigs(const graph_t<wt_t> &graph, const size_t solid, const size_t min_length) {
   // TODO: Compute unitigs starting from nodes with rank in [i, j] in parallel
 
   const std::vector<interval_t> kmers = graph.distinct_kmers(solid);
@@ -28,6 +38,9 @@ void compute_unitigs(const graph_t &graph, const size_t solid, const size_t min_
 
   sdsl::bit_vector visited = sdsl::bit_vector(graph.rank(kmers.back()) + 1, false);
 
+  // Neighbours are written to buffers with room for every symbol
+  std::vector<interval_t> incoming(graph.sigma()), in(graph.sigma());
+
   size_t unitig_count = 0;
   for (size_t i = 0; i < kmers.size(); i++) {
     const interval_t node = kmers[i];
@@ -35,29 +48,29 @@ void compute_unitigs(const graph_t &graph, const size_t solid, const size_t min_
     if (visited[rank]) continue;
     visited[rank] = true;
 
-    const std::vector<interval_t> incoming = graph.incoming(node, solid);
+    const size_t indegree = graph.incoming(node, incoming.data(), solid);
 
     #ifdef DEBUG
       std::cerr << "[D::" << __func__ << "]: " <<
         "(" << node.left << ", " << node.right << ") = (" << graph.label(node) << "): " <<
-        "in: " << incoming.size() << ", out: " << graph.outdegree(node, solid) << ", f: " << frequency(node) << std::endl;
+        "in: " << indegree << ", out: " << graph.outdegree(node, solid) << ", f: " << frequency(node) << std::endl;
 
-      for (size_t j = 0; j < incoming.size(); j++) {
+      for (size_t j = 0; j < indegree; j++) {
         std::cerr << "\t (" << incoming[j].left << ", " << incoming[j].right << ")" << std::endl;
       }
       std::cerr << std::endl;
     #endif
 
     // Maximal unitigs start from nodes with outdegree > 1
-    if (incoming.size() == 1 && graph.outdegree(node, solid) > 1) {
+    if (indegree == 1 && graph.outdegree(node, solid) > 1) {
       std::vector<interval_t> path;
       path.push_back(node);
 
       // Traverse graph backwards until a non-unary node or the starting node
       // is reached
       interval_t n = incoming[0];
-      std::vector<interval_t> in = graph.incoming(n, solid);
-      while (in.size() == 1 && n != node) {
+      size_t degree = graph.incoming(n, in.data(), solid);
+      while (degree == 1 && n != node) {
         // Mark all visited nodes
         const size_t r = graph.rank(n);
         visited[r] = true;
@@ -65,7 +78,7 @@ void compute_unitigs(const graph_t &graph, const size_t solid, const size_t min_
         // Add node to path and get next node
         path.push_back(n);
         n = in[0];
-        in = graph.incoming(n, solid);
+        degree = graph.incoming(n, in.data(), solid);
       }
 
       // k + |v| - 1 = |path|
@@ -80,21 +93,41 @@ void compute_unitigs(const graph_t &graph, const size_t solid, const size_t min_
   std::cerr << "[V::" << __func__ << "]: " << unitig_count << " unitigs" << std::endl;
 }
 
+// Assembles a graph with the BWT represented by wt_t
+struct assemble_task_t {
+  std::string prefix;
+  size_t solid, min_length, k;
+
+  template<class wt_t>
+  void run() const {
+    // Load graph
+    graph_t<wt_t> graph = graph_t<wt_t>::load(prefix);
+
+    // Assemble with a different k than the graph was built with
+    if (k != 0) {
+      phase_t phase("change_k");
+      graph.change_k(k);
+    }
+
+    // Compute unitigs
+    phase_t phase("unitigs");
+    compute_unitigs(graph, solid, min_length);
+  }
+};
+
 int main(int argc, char* argv[]) {
-  if (argc != 4) {
-    std::cerr << "Usage: " << argv[0] << " <graph prefix> <s> <min length>" << std::endl;
+  if (argc != 4 && argc != 5) {
+    std::cerr << "Usage: " << argv[0] << " <graph prefix> <s> <min length> [k]" << std::endl;
     return 1;
   }
 
-  const std::string prefix = argv[1];
-  const size_t solid = std::stoi(argv[2]);
-  const size_t min_length = std::stoi(argv[3]);
-
-  // Load graph
-  const graph_t graph = graph_t::load(prefix);
+  assemble_task_t task;
+  task.prefix = argv[1];
+  task.solid = std::stoi(argv[2]);
+  task.min_length = std::stoi(argv[3]);
+  task.k = (argc == 5) ? std::stoi(argv[4]) : 0;
 
-  // Compute unitigs
-  compute_unitigs(graph, solid, min_length);
+  dispatch_backend(stored_backend(task.prefix), task);
 
   return 0;
 }
@@ -1,26 +1,363 @@
 // Copyright 2017 Riku Walve
 
+#include <getopt.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
 #include <vector>
 #include <string>
 #include <iostream>
 
+#include "backend.h"
+#include "checkpoint.h"
 #include "graph.h"
+#include "memory.h"
+#include "profile.h"
+
+// Splits a stream into partitions of about equal size at read separators.
+// Every partition ends with a separator, like the stream itself.
+std::vector<std::string> partition_stream(const std::string &in, const size_t partitions,
+    const std::string &prefix) {
+  std::ifstream stream(in, std::ios::binary | std::ios::ate);
+  if (!stream.good()) {
+    std::cerr << "[E::" << __func__ << "]: Unable to read \"" << in << "\"!" << std::endl;
+    exit(1);
+  }
+
+  const size_t n = static_cast<size_t>(stream.tellg());
+  const size_t target = (n + partitions - 1) / partitions;
+
+  // Each partition ends after the first separator past its target length
+  std::vector<size_t> ends;
+  for (size_t p = 1; p < partitions && p * target < n; p++) {
+    stream.seekg(static_cast<std::streamoff>(p * target - 1));
+
+    size_t end = p * target - 1;
+    char c;
+    while (stream.get(c) && c != MARKER)
+      end++;
+
+    if (c == MARKER && end + 1 < n && (ends.empty() || end + 1 > ends.back())) {
+      ends.push_back(end + 1);
+    }
+  }
+  ends.push_back(n);
+
+  stream.clear();
+  stream.seekg(0);
+
+  std::vector<std::string> filenames;
+  std::vector<char> buffer(1 << 20);
+  size_t begin = 0;
+  for (size_t p = 0; p < ends.size(); p++) {
+    filenames.push_back(prefix + ".part." + std::to_string(p));
+    std::ofstream out(filenames.back(), std::ios::binary);
+    if (!out.good()) {
+      std::cerr << "[E::" << __func__ << "]: Unable to write to \"" << filenames.back() << "\"!" << std::endl;
+      exit(1);
+    }
+
+    for (size_t i = begin; i < ends[p]; i += buffer.size()) {
+      const size_t count = std::min(buffer.size(), ends[p] - i);
+      stream.read(buffer.data(), static_cast<std::streamsize>(count));
+      out.write(buffer.data(), static_cast<std::streamsize>(count));
+    }
+    begin = ends[p];
+  }
+
+  return filenames;
+}
+
+static size_t file_size(const std::string &filename) {
+  std::ifstream in(filename, std::ios::binary | std::ios::ate);
+  if (!in.good()) {
+    std::cerr << "[E::" << __func__ << "]: Unable to read \"" << filename << "\"!" << std::endl;
+    exit(1);
+  }
+
+  return static_cast<size_t>(in.tellg());
+}
+
+// Concatenates streams into one
+void concatenate_streams(const std::string &a, const std::string &b, const std::string &out) {
+  std::ofstream stream(out, std::ios::binary);
+  stream << std::ifstream(a, std::ios::binary).rdbuf();
+  stream << std::ifstream(b, std::ios::binary).rdbuf();
+}
+
+// Runs the tasks in separate processes at the same time, exiting if any of
+// them fails
+template<typename task_t>
+void run_processes(const size_t count, const task_t &task) {
+  std::vector<pid_t> children;
+  for (size_t i = 0; i < count; i++) {
+    const pid_t pid = fork();
+    if (pid == 0) {
+      // The parent measures the processes as a whole
+      profiler_t::instance().disable();
+      task(i);
+      _exit(0);
+    } else if (pid < 0) {
+      std::cerr << "[E::" << __func__ << "]: Unable to start a process!" << std::endl;
+      exit(1);
+    }
+    children.push_back(pid);
+  }
+
+  bool failed = false;
+  for (size_t i = 0; i < children.size(); i++) {
+    int status;
+    waitpid(children[i], &status, 0);
+    failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+  }
+
+  if (failed) {
+    std::cerr << "[E::" << __func__ << "]: A build process failed!" << std::endl;
+    exit(1);
+  }
+}
+
+// Builds the graphs of the partitions of a stream in separate processes,
+// then merges them pairwise until one graph is left
+template<class wt_t>
+void partitioned_build(const std::string &in, const size_t k, const std::string &prefix,
+    const size_t kmax, const size_t partitions, const long ram_use, const size_t sample_density,
+    const bool psi, const bool packed_text) {
+  std::vector<std::string> streams;
+  {
+    phase_t phase("partition");
+    streams = partition_stream(in, partitions, prefix);
+  }
+
+  std::vector<std::string> graphs(streams.size());
+  for (size_t i = 0; i < streams.size(); i++) {
+    graphs[i] = streams[i] + ".graph";
+  }
+
+  // As many partitions are built at the same time as the budget fits, and
+  // at least one. Each process gets an equal share of the budget.
+  long required = 0;
+  for (size_t i = 0; i < streams.size(); i++) {
+    required = std::max(required, graph_t<wt_t>::min_ram_use(file_size(streams[i]), kmax,
+      sample_density, psi));
+  }
+  const size_t concurrent = std::max(1L, std::min(static_cast<long>(streams.size()),
+    ram_use / required));
+  const long process_ram_use = ram_use / static_cast<long>(concurrent);
+
+  std::cerr << "[V::" << __func__ << "]: Building " << streams.size() << " partitions, " <<
+    concurrent << " at a time" << std::endl;
+  {
+    phase_t phase("build_partitions");
+    for (size_t begin = 0; begin < streams.size(); begin += concurrent) {
+      run_processes(std::min(concurrent, streams.size() - begin), [&](const size_t p) {
+        const size_t i = begin + p;
+        graph_t<wt_t> graph(streams[i], k, kmax, process_ram_use, nullptr, sample_density, psi);
+        if (packed_text) {
+          graph.pack_text(streams[i]);
+        }
+        graph.store_to_file(graphs[i]);
+      });
+    }
+  }
+
+  while (graphs.size() > 1) {
+    const size_t pairs = graphs.size() / 2;
+    std::cerr << "[V::" << __func__ << "]: Merging " << pairs << " pairs" << std::endl;
+
+    std::vector<std::string> merged_streams, merged_graphs;
+    for (size_t i = 0; i < pairs; i++) {
+      merged_streams.push_back(streams[2 * i] + "-" + std::to_string(graphs.size()));
+      merged_graphs.push_back(merged_streams.back() + ".graph");
+    }
+
+    // As many merges run at the same time as the budget fits, and at least
+    // one. The packed texts are merged too.
+    long required = 0;
+    for (size_t i = 0; i < pairs; i++) {
+      const size_t n = file_size(streams[2 * i]), m = file_size(streams[2 * i + 1]);
+      required = std::max(required, graph_t<wt_t>::merge_ram_use(n, m, kmax, sample_density, psi) +
+        (packed_text ? static_cast<long>((n + m) / 4) : 0));
+    }
+    const size_t concurrent = std::max(1L, std::min(static_cast<long>(pairs), ram_use / required));
+    if (ram_use < required) {
+      std::cerr << "[V::" << __func__ << "]: Merging needs about " << ((required >> 20) + 1) <<
+        " MiB, over the RAM budget of " << (ram_use >> 20) << " MiB" << std::endl;
+    }
+
+    phase_t phase("merge_partitions");
+    for (size_t begin = 0; begin < pairs; begin += concurrent) {
+      run_processes(std::min(concurrent, pairs - begin), [&](const size_t p) {
+        const size_t i = begin + p;
+        const graph_t<wt_t> a = graph_t<wt_t>::load(graphs[2 * i]);
+        const graph_t<wt_t> b = graph_t<wt_t>::load(graphs[2 * i + 1]);
+        graph_t<wt_t>::merge(a, b, streams[2 * i + 1]).store_to_file(merged_graphs[i]);
+      });
+    }
+
+    for (size_t i = 0; i < pairs; i++) {
+      concatenate_streams(streams[2 * i], streams[2 * i + 1], merged_streams[i]);
+      for (size_t j = 2 * i; j <= 2 * i + 1; j++) {
+        std::remove(streams[j].c_str());
+        std::remove((graphs[j] + ".wanda").c_str());
+      }
+    }
+
+    // An odd graph out is merged on the next round
+    if (graphs.size() % 2 == 1) {
+      merged_streams.push_back(streams.back());
+      merged_graphs.push_back(graphs.back());
+    }
+
+    streams.swap(merged_streams);
+    graphs.swap(merged_graphs);
+  }
+
+  std::remove(streams[0].c_str());
+  std::rename((graphs[0] + ".wanda").c_str(), (prefix + ".wanda").c_str());
+}
+
+// Builds the graph with the BWT represented by wt_t
+struct build_task_t {
+  std::string in, prefix;
+  size_t k, kmax, partitions, sample_density;
+  long ram_use;
+  bool checkpointing, psi, packed_text;
+
+  template<class wt_t>
+  void run() const {
+    // Fail before doing any work if a partition can not be built on its own
+    const size_t n = file_size(in);
+    const long required = graph_t<wt_t>::min_ram_use((n + partitions - 1) / partitions, kmax,
+      sample_density, psi);
+    std::cerr << "[V::" << __func__ << "]: RAM budget of " << (ram_use >> 20) << " MiB" << std::endl;
+    if (ram_use < required) {
+      std::cerr << "[E::" << __func__ << "]: RAM budget of " << (ram_use >> 20) <<
+        " MiB is too small, about " << ((required >> 20) + 1) << " MiB is needed!" << std::endl;
+      exit(1);
+    }
+
+    // Temporary files are named after the stream or the graph
+    profiler_t::instance().watch(in);
+    profiler_t::instance().watch(prefix);
+
+    if (partitions > 1) {
+      partitioned_build<wt_t>(in, k, prefix, kmax, partitions, ram_use, sample_density, psi,
+        packed_text);
+      return;
+    }
+
+    // Construct graph
+    phase_t phase("build");
+    checkpoint_t *checkpoint = checkpointing ?
+      new checkpoint_t(prefix, in, k, kmax, backend_traits<wt_t>::id, sample_density, psi) :
+      nullptr;
+    graph_t<wt_t> graph(in, k, kmax, ram_use, checkpoint, sample_density, psi);
+    if (packed_text) {
+      graph.pack_text(in);
+    }
+
+    // Save graph to file
+    graph.store_to_file(prefix);
+
+    if (checkpoint != nullptr) {
+      checkpoint->finish();
+      delete checkpoint;
+    }
+  }
+};
 
 int main(int argc, char* argv[]) {
-  if (argc != 4) {
-    std::cerr << "Usage: " << argv[0] << " <stream> <k> <graph prefix>" << std::endl;
+  size_t partitions = 1;
+  size_t sample_density = SA_SAMPLE_DENSITY;
+  long ram_use = 0;
+  bool checkpointing = false, psi = false, packed_text = false;
+  backend_t backend = BACKEND_HUFF_RRR;
+
+  const struct option options[] = {
+    { "backend", required_argument, nullptr, 'b' },
+    { "checkpoint", no_argument, nullptr, 'c' },
+    { "psi", no_argument, nullptr, 'f' },
+    { "mem", required_argument, nullptr, 'm' },
+    { "partitions", required_argument, nullptr, 'p' },
+    { "sample", required_argument, nullptr, 's' },
+    { "text", no_argument, nullptr, 't' },
+    { nullptr, 0, nullptr, 0 }
+  };
+
+  int option;
+  while ((option = getopt_long(argc, argv, "b:cfm:p:s:t", options, nullptr)) != -1) {
+    switch (option) {
+      case 'b':
+        backend = parse_backend(optarg);
+        break;
+      case 'c':
+        checkpointing = true;
+        break;
+      case 'f':
+        psi = true;
+        break;
+      case 'm':
+        ram_use = parse_memory(optarg);
+        break;
+      case 'p':
+        partitions = std::stoul(optarg);
+        break;
+      case 's':
+        sample_density = std::stoul(optarg);
+        break;
+      case 't':
+        packed_text = true;
+        break;
+      default:
+        break;
+    }
+  }
+
+  const int args = argc - optind;
+  if ((args != 3 && args != 4) || partitions == 0 || sample_density == 0) {
+    std::cerr << "Usage: " << argv[0] << " [-b backend] [-c] [-f] [-m mem] [-p partitions] [-s density] [-t] <stream> <k> <graph prefix> [max k]" << std::endl;
+    return 1;
+  }
+
+  const std::string in = argv[optind];
+  const size_t k = std::stoi(argv[optind + 1]);
+  const std::string prefix = argv[optind + 2];
+  const size_t kmax = (args == 4) ? std::stoi(argv[optind + 3]) : 0;
+
+  if (kmax != 0 && (kmax < k || kmax > MAX_STORED_K)) {
+    std::cerr << "[E::" << __func__ << "]: max k must be between k and " <<
+      MAX_STORED_K << "!" << std::endl;
     return 1;
   }
 
-  const std::string in = argv[1];
-  const size_t k = std::stoi(argv[2]);
-  const std::string prefix = argv[3];
+  // Without a budget, stay within the cgroup limit if there is one
+  if (ram_use == 0) {
+    ram_use = default_ram_use(DEFAULT_RAM_USE);
+  }
 
-  // Construct graph
-  const graph_t graph(in, k);
+  // Partitions are cheap to rebuild compared to the whole stream, so only
+  // single process builds are checkpointed
+  if (checkpointing && partitions > 1) {
+    std::cerr << "[E::" << __func__ << "]: Checkpointing needs a single partition!" << std::endl;
+    return 1;
+  }
 
-  // Save graph to file
-  graph.store_to_file(prefix);
+  build_task_t task;
+  task.in = in;
+  task.prefix = prefix;
+  task.k = k;
+  task.kmax = kmax;
+  task.partitions = partitions;
+  task.sample_density = sample_density;
+  task.ram_use = ram_use;
+  task.checkpointing = checkpointing;
+  task.psi = psi;
+  task.packed_text = packed_text;
+  dispatch_backend(backend, task);
 
   return 0;
 }
@@ -0,0 +1,93 @@
+// Copyright 2017 Riku Walve
+
+#include <getopt.h>
+
+#include <fstream>
+#include <vector>
+#include <string>
+#include <iostream>
+
+#include "graph.h"
+#include "memory.h"
+
+static size_t file_size(const std::string &filename) {
+  std::ifstream in(filename, std::ios::binary | std::ios::ate);
+  if (!in.good()) {
+    std::cerr << "[E::" << __func__ << "]: Unable to read \"" << filename << "\"!" << std::endl;
+    exit(1);
+  }
+
+  return static_cast<size_t>(in.tellg());
+}
+
+// Appends a stream to a graph with the BWT represented by wt_t
+struct merge_task_t {
+  std::string prefix, in, output, stream_prefix;
+  long ram_use;
+
+  template<class wt_t>
+  void run() const {
+    const graph_t<wt_t> graph = graph_t<wt_t>::load(prefix);
+
+    // Fail before merging if the budget is too small
+    const long required = graph.append_ram_use(file_size(in), stream_prefix.empty());
+    std::cerr << "[V::" << __func__ << "]: RAM budget of " << (ram_use >> 20) << " MiB" << std::endl;
+    if (ram_use < required) {
+      std::cerr << "[E::" << __func__ << "]: RAM budget of " << (ram_use >> 20) <<
+        " MiB is too small, about " << ((required >> 20) + 1) << " MiB is needed!" << std::endl;
+      exit(1);
+    }
+
+    // Append the stream to the graph, reusing the graph of the stream if it
+    // was already built
+    const graph_t<wt_t> merged = !stream_prefix.empty() ?
+      graph_t<wt_t>::merge(graph, graph_t<wt_t>::load(stream_prefix), in) :
+      graph_t<wt_t>::merge(graph, in, ram_use);
+
+    // Save graph to file
+    merged.store_to_file(output);
+  }
+};
+
+int main(int argc, char* argv[]) {
+  long ram_use = 0;
+
+  const struct option options[] = {
+    { "mem", required_argument, nullptr, 'm' },
+    { nullptr, 0, nullptr, 0 }
+  };
+
+  int option;
+  while ((option = getopt_long(argc, argv, "m:", options, nullptr)) != -1) {
+    switch (option) {
+      case 'm':
+        ram_use = parse_memory(optarg);
+        break;
+      default:
+        break;
+    }
+  }
+
+  const int args = argc - optind;
+  if (args != 3 && args != 4) {
+    std::cerr << "Usage: " << argv[0] << " [-m mem] <graph prefix> <stream> <output prefix> [stream graph prefix]" << std::endl;
+    return 1;
+  }
+
+  // Without a budget, stay within the cgroup limit if there is one
+  if (ram_use == 0) {
+    ram_use = default_ram_use(DEFAULT_RAM_USE);
+  }
+
+  merge_task_t task;
+  task.prefix = argv[optind];
+  task.in = argv[optind + 1];
+  task.output = argv[optind + 2];
+  task.stream_prefix = (args == 4) ? argv[optind + 3] : "";
+  task.ram_use = ram_use;
+
+  // The merged graph keeps the backend of the graph appended to
+  dispatch_backend(stored_backend(task.prefix), task);
+
+  return 0;
+}